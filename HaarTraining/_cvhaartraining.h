@@ -346,6 +346,31 @@ typedef struct CvVecFile
 
 int icvGetHaarTraininDataFromVecCallback( CvMat* img, void* userdata );
 
+/*
+ * Memory mapped .vec file
+ *
+ * Samples are converted from the mapping directly into the training window,
+ * so that no read call is issued per sample, and any sample can be read
+ * by its index.
+ */
+typedef struct CvVecMap
+{
+    const uchar* base;    /* beginning of the file */
+    size_t       size;    /* size of the file in bytes */
+    int          count;   /* number of complete samples */
+    int          vecsize;
+    int          last;    /* next sample of icvGetHaarTraininDataFromVecMapCallback */
+#ifdef _WIN32
+    void*        file;    /* HANDLE of the file */
+    void*        mapping; /* HANDLE of the file mapping */
+#endif /* _WIN32 */
+} CvVecMap;
+
+int  icvOpenVecMap( CvVecMap* map, const char* filename );
+void icvCloseVecMap( CvVecMap* map );
+int  icvGetVecMapSample( const CvVecMap* map, int index, CvMat* img );
+int  icvGetHaarTraininDataFromVecMapCallback( CvMat* img, void* userdata );
+
 /*
  * icvGetHaarTrainingDataFromVec
  *
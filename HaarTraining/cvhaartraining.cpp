@@ -53,6 +53,21 @@
 #include <math.h>
 #include <highgui.h>
 #include <limits.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else /* _WIN32 */
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif /* _WIN32 */
+
+#if defined __SSE2__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define ICV_VEC_SSE2
+#endif
 
 #ifdef CV_VERBOSE
 #include <time.h>
@@ -1777,11 +1792,203 @@ int icvGetHaarTrainingDataFromBG( CvHaarTrainingData* data, int first, int count
 }
 
 
+/* count, vecsize, and two reserved shorts */
+#define ICV_VEC_HEADER_SIZE (2 * sizeof( int ) + 2 * sizeof( short ))
+
+/*
+ * icvVecToUchar
+ *
+ * Convert <n> shorts of a .vec sample to uchar as (uchar) cast does.
+ * <src> need not be aligned (samples follow a 1 byte gap in .vec files).
+ */
+static
+void icvVecToUchar( const uchar* src, uchar* dst, int n )
+{
+    int i = 0;
+    short val = 0;
+
+#ifdef ICV_VEC_SSE2
+    const __m128i mask = _mm_set1_epi16( 0xff );
+    for( ; i <= n - 16; i += 16 )
+    {
+        __m128i v0 = _mm_loadu_si128( (const __m128i*) (src + 2 * i) );
+        __m128i v1 = _mm_loadu_si128( (const __m128i*) (src + 2 * i + 16) );
+        /* keep the lower bytes so that packing does not saturate */
+        v0 = _mm_and_si128( v0, mask );
+        v1 = _mm_and_si128( v1, mask );
+        _mm_storeu_si128( (__m128i*) (dst + i), _mm_packus_epi16( v0, v1 ) );
+    }
+#endif /* ICV_VEC_SSE2 */
+    for( ; i < n; i++ )
+    {
+        memcpy( &val, src + 2 * i, sizeof( val ) );
+        dst[i] = (uchar) val;
+    }
+}
+
+/*
+ * icvVecSampleToMat
+ *
+ * Convert a .vec sample (vector of shorts) into <img>
+ */
+static
+void icvVecSampleToMat( const uchar* src, CvMat* img )
+{
+    int r = 0;
+
+    if( CV_IS_MAT_CONT( img->type ) )
+    {
+        icvVecToUchar( src, img->data.ptr, img->rows * img->cols );
+        return;
+    }
+    for( r = 0; r < img->rows; r++ )
+    {
+        icvVecToUchar( src + 2 * r * img->cols, img->data.ptr + r * img->step, img->cols );
+    }
+}
+
+/*
+ * icvOpenVecMap
+ *
+ * Map a .vec file into memory
+ *
+ * Returns 0 if the file cannot be opened or mapped.
+ */
+int icvOpenVecMap( CvVecMap* map, const char* filename )
+{
+    size_t samplesize = 0;
+
+    memset( map, 0, sizeof( *map ) );
+    if( filename == NULL ) return 0;
+
+#ifdef _WIN32
+    LARGE_INTEGER filesize;
+
+    map->file = CreateFileA( filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+                             OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+    if( map->file == INVALID_HANDLE_VALUE )
+    {
+        map->file = NULL;
+        return 0;
+    }
+    if( GetFileSizeEx( (HANDLE) map->file, &filesize ) &&
+        filesize.QuadPart >= (LONGLONG) ICV_VEC_HEADER_SIZE )
+    {
+        map->size = (size_t) filesize.QuadPart;
+        map->mapping = CreateFileMappingA( (HANDLE) map->file, NULL, PAGE_READONLY,
+                                           0, 0, NULL );
+        if( map->mapping != NULL )
+        {
+            map->base = (const uchar*) MapViewOfFile( (HANDLE) map->mapping,
+                                                      FILE_MAP_READ, 0, 0, 0 );
+        }
+    }
+#else /* _WIN32 */
+    struct stat st;
+    int fd = open( filename, O_RDONLY );
+
+    if( fd < 0 ) return 0;
+    if( fstat( fd, &st ) == 0 && st.st_size >= (off_t) ICV_VEC_HEADER_SIZE )
+    {
+        void* addr = mmap( NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+        if( addr != MAP_FAILED )
+        {
+            map->size = (size_t) st.st_size;
+            map->base = (const uchar*) addr;
+#ifdef MADV_SEQUENTIAL
+            madvise( addr, map->size, MADV_SEQUENTIAL );
+#endif /* MADV_SEQUENTIAL */
+        }
+    }
+    close( fd ); /* the mapping remains */
+#endif /* _WIN32 */
+
+    if( map->base == NULL )
+    {
+        icvCloseVecMap( map );
+        return 0;
+    }
+
+    memcpy( &map->count, map->base, sizeof( map->count ) );
+    memcpy( &map->vecsize, map->base + sizeof( int ), sizeof( map->vecsize ) );
+    map->last = 0;
+
+    /* only complete samples of a truncated file are read */
+    if( map->vecsize > 0 )
+    {
+        samplesize = 1 + sizeof( short ) * map->vecsize;
+        map->count = (int) MIN( (size_t) MAX( map->count, 0 ),
+                                (map->size - ICV_VEC_HEADER_SIZE) / samplesize );
+    }
+    else
+    {
+        map->count = 0;
+    }
+
+    return 1;
+}
+
+/*
+ * icvCloseVecMap
+ *
+ * Unmap a .vec file mapped by icvOpenVecMap
+ */
+void icvCloseVecMap( CvVecMap* map )
+{
+#ifdef _WIN32
+    if( map->base != NULL ) UnmapViewOfFile( map->base );
+    if( map->mapping != NULL ) CloseHandle( (HANDLE) map->mapping );
+    if( map->file != NULL ) CloseHandle( (HANDLE) map->file );
+    map->mapping = NULL;
+    map->file = NULL;
+#else /* _WIN32 */
+    if( map->base != NULL ) munmap( (void*) map->base, map->size );
+#endif /* _WIN32 */
+    map->base = NULL;
+    map->size = 0;
+}
+
+/*
+ * icvGetVecMapSample
+ *
+ * Convert the <index>-th sample of a mapped .vec file into <img>
+ *
+ * Returns 0 if <index> is out of range.
+ */
+int icvGetVecMapSample( const CvVecMap* map, int index, CvMat* img )
+{
+    size_t samplesize = 1 + sizeof( short ) * map->vecsize;
+
+    assert( img->rows * img->cols == map->vecsize );
+    assert( CV_MAT_TYPE( img->type ) == CV_8UC1 );
+
+    if( index < 0 || index >= map->count )
+    {
+        return 0;
+    }
+
+    /* each sample is a 1 byte gap followed by <vecsize> shorts */
+    icvVecSampleToMat( map->base + ICV_VEC_HEADER_SIZE + samplesize * index + 1, img );
+
+    return 1;
+}
+
+int icvGetHaarTraininDataFromVecMapCallback( CvMat* img, void* userdata )
+{
+    CvVecMap* map = (CvVecMap*) userdata;
+
+    if( !icvGetVecMapSample( map, map->last, img ) )
+    {
+        return 0;
+    }
+    map->last++;
+
+    return 1;
+}
+
 int icvGetHaarTraininDataFromVecCallback( CvMat* img, void* userdata )
 {
     uchar tmp = 0;
-    int r = 0;
-    int c = 0;
 
     assert( img->rows * img->cols == ((CvVecFile*) userdata)->vecsize );
     
@@ -1795,14 +2002,7 @@ int icvGetHaarTraininDataFromVecCallback( CvMat* img, void* userdata )
         return 0;
     }
     
-    for( r = 0; r < img->rows; r++ )
-    {
-        for( c = 0; c < img->cols; c++ )
-        {
-            CV_MAT_ELEM( *img, uchar, r, c ) = 
-                (uchar) ( ((CvVecFile*) userdata)->vector[r * img->cols + c] );
-        }
-    }
+    icvVecSampleToMat( (const uchar*) ((CvVecFile*) userdata)->vector, img );
 
     return 1;
 }
@@ -1824,8 +2024,24 @@ int icvGetHaarTrainingDataFromVec( CvHaarTrainingData* data, int first, int coun
     __BEGIN__;
 
     CvVecFile file;
+    CvVecMap map;
     short tmp = 0;    
     
+    if( icvOpenVecMap( &map, filename ) )
+    {
+        if( map.vecsize != data->winsize.width * data->winsize.height )
+        {
+            icvCloseVecMap( &map );
+            CV_ERROR( CV_StsError, "Vec file sample size mismatch" );
+        }
+
+        getcount = icvGetHaarTrainingData( data, first, count, cascade,
+            icvGetHaarTraininDataFromVecMapCallback, &map, consumed );
+        icvCloseVecMap( &map );
+        EXIT;
+    }
+
+    /* fall back to stdio if the file cannot be mapped */
     file.input = NULL;
     if( filename ) file.input = fopen( filename, "rb" );
 
@@ -159,6 +159,80 @@ cvCropImageROI( const IplImage* img, IplImage* dst,
     __END__;
 }
 
+/**
+ * Sample a rotated rectangle region at a given size
+ *
+ * This approximates cvCropImageROI( img, patch, rect32f ) followed by 
+ * cvResize( patch, dst, CV_INTER_LINEAR ), but each pixel of the given 
+ * size is interpolated bilinearly from img directly, so no patch is 
+ * created and nothing is allocated. It differs from the two steps in 
+ * that values are not rounded into the patch in between, and samples 
+ * near the border of the rectangle use img pixels just outside of it 
+ * where cvResize clamps to the border of the patch. 
+ * Pixels outside of img are 0 as cvCropImageROI does. 
+ *
+ * @param img      The target image (IPL_DEPTH_8U or IPL_DEPTH_32F)
+ * @param rect32f  The rectangle region (x,y,width,height) and 
+ *                 the rotation angle in degree where the rotation center is (x,y)
+ * @param size     Size to sample at
+ * @param func     Called as func( u, v, ch, val ) for each pixel (u,v) 
+ *                 and channel ch. val is not rounded even for IPL_DEPTH_8U
+ */
+template<typename Func>
+inline void icvCropResizeImageROI( const IplImage* img, CvRect32f rect32f, 
+                                   CvSize size, Func& func )
+{
+    CvRect rect = cvRectFromRect32f( rect32f );
+    int nch = img->nChannels;
+    int u, v, ch, ix, iy, x0, x1, y0, y1;
+    double c = cos( -M_PI / 180 * rect32f.angle );
+    double s = sin( -M_PI / 180 * rect32f.angle );
+    // patch pixel (x,y) corresponding to resized pixel (u,v) as cvResize
+    double sx = (double)rect.width / size.width;
+    double sy = (double)rect.height / size.height;
+    double ox = 0.5 * sx - 0.5, oy = 0.5 * sy - 0.5;
+    double xp, yp, dx, dy;
+    const uchar *r0, *r1;
+
+    assert( img->depth == IPL_DEPTH_8U || img->depth == IPL_DEPTH_32F );
+    for( v = 0; v < size.height; v++ )
+    {
+        // image position of (u,v) is origin + u * (c*sx, s*sx)
+        double y = v * sy + oy;
+        xp = rect.x + c * ox - s * y;
+        yp = rect.y + s * ox + c * y;
+        for( u = 0; u < size.width; u++, xp += c * sx, yp += s * sx )
+        {
+            if( xp <= -0.5 || xp >= img->width - 0.5 || 
+                yp <= -0.5 || yp >= img->height - 0.5 )
+            {
+                for( ch = 0; ch < nch; ch++ )
+                    func( u, v, ch, 0.0 );
+                continue;
+            }
+            ix = cvFloor( xp ); iy = cvFloor( yp );
+            dx = xp - ix; dy = yp - iy;
+            x0 = MAX( ix, 0 ) * nch; x1 = MIN( ix + 1, img->width - 1 ) * nch;
+            y0 = MAX( iy, 0 ); y1 = MIN( iy + 1, img->height - 1 );
+            r0 = (const uchar*)( img->imageData + img->widthStep * y0 );
+            r1 = (const uchar*)( img->imageData + img->widthStep * y1 );
+            for( ch = 0; ch < nch; ch++ )
+            {
+                if( img->depth == IPL_DEPTH_8U )
+                    func( u, v, ch, ( r0[x0 + ch] * ( 1 - dx ) + r0[x1 + ch] * dx ) * ( 1 - dy ) + 
+                                    ( r1[x0 + ch] * ( 1 - dx ) + r1[x1 + ch] * dx ) * dy );
+                else
+                {
+                    const float* f0 = (const float*)r0;
+                    const float* f1 = (const float*)r1;
+                    func( u, v, ch, ( f0[x0 + ch] * ( 1 - dx ) + f0[x1 + ch] * dx ) * ( 1 - dy ) + 
+                                    ( f1[x0 + ch] * ( 1 - dx ) + f1[x1 + ch] * dx ) * dy );
+                }
+            }
+        }
+    }
+}
+
 /**
  * Crop and show the Cropped Image
  *
@@ -112,8 +112,8 @@ icvGet2DInterLinear( const CvArr *arr, float row, float col )
 
     for( ch = 0; ch < img->nChannels; ch++ )
     {
-        color.val[ch] = ( c[0].val[ch] * dx + c[1].val[ch] * (1 - dx) ) * dy
-            + ( c[2].val[ch] * dx + c[3].val[ch] * (1 - dx) ) * (1 - dy);
+        color.val[ch] = ( c[0].val[ch] * (1 - dx) + c[1].val[ch] * dx ) * (1 - dy)
+            + ( c[2].val[ch] * (1 - dx) + c[3].val[ch] * dx ) * dy;
     }
     __END__;
     return color;
@@ -31,6 +31,58 @@
 #include <float.h>
 #include <math.h>
 
+#define CV_LOGSUM_BLOCK 64 /**< values processed at once by cvLogSumExp */
+
+/**
+ * Compute log(sum) of log values in one pass
+ *
+ * The running maximum is updated once per block of CV_LOGSUM_BLOCK values, 
+ * and exp of a block is taken relative to the maximum so far, so that 
+ * values are read once and the exp loop can be vectorized. 
+ *
+ * @param  x         n log values
+ * @param  n         number of values
+ * @return log sum. -DBL_MAX if n == 0 or all values are -inf
+ */
+template<typename T>
+inline double cvLogSumExp( const T* x, int n )
+{
+    double maxval = -DBL_MAX, sum = 0;
+    int i, start, end;
+    for( start = 0; start < n; start += CV_LOGSUM_BLOCK )
+    {
+        end = MIN( start + CV_LOGSUM_BLOCK, n );
+        double blockmax = maxval;
+        for( i = start; i < end; i++ )
+            blockmax = x[i] > blockmax ? x[i] : blockmax;
+        if( blockmax > maxval )
+        {
+            sum *= exp( maxval - blockmax );
+            maxval = blockmax;
+        }
+        for( i = start; i < end; i++ )
+            sum += exp( x[i] - maxval );
+    }
+    return sum > 0 ? maxval + log( sum ) : -DBL_MAX;
+}
+
+/**
+ * Normalize log values in place so that the sum of exp becomes 1
+ *
+ * @param  x         n log values
+ * @param  n         number of values
+ * @return log sum before normalization
+ * @see cvLogSumExp
+ */
+template<typename T>
+inline double cvLogNormalize( T* x, int n )
+{
+    double logsum = cvLogSumExp( x, n );
+    for( int i = 0; i < n; i++ )
+        x[i] = (T)( x[i] - logsum );
+    return logsum;
+}
+
 /**
  * Compute log(sum) of log values
  *
@@ -51,6 +103,24 @@ CVAPI(CvScalar) cvLogSum( const CvArr *arr )
     CV_FUNCNAME( "cvLogSum" );
     __BEGIN__;
 
+    // fast path for a continuous single channel matrix
+    if( CV_IS_MAT( arr ) && CV_IS_MAT_CONT( ((CvMat*)arr)->type ) && 
+        CV_MAT_CN( ((CvMat*)arr)->type ) == 1 )
+    {
+        const CvMat* mat = (const CvMat*)arr;
+        sumval = cvScalar( 0 );
+        if( CV_MAT_DEPTH( mat->type ) == CV_64F )
+        {
+            sumval.val[0] = cvLogSumExp( mat->data.db, mat->rows * mat->cols );
+            EXIT;
+        }
+        if( CV_MAT_DEPTH( mat->type ) == CV_32F )
+        {
+            sumval.val[0] = cvLogSumExp( mat->data.fl, mat->rows * mat->cols );
+            EXIT;
+        }
+    }
+
     if( !CV_IS_IMAGE(img) )
     {
         CV_CALL( img = cvGetImage( img, &imgstub ) );
@@ -0,0 +1,358 @@
+/** @file
+ * Particle Filter for multiple targets
+ *
+ * Particles of all targets are stored in one CvParticle whose columns
+ * [t * num_particles, (t + 1) * num_particles) belong to the target t,
+ * so that transition (noise generation, dynamics GEMM, bounding) and
+ * resampling run once for all targets rather than once per target.
+ * All targets share the configuration (dynamics, noise, bound, resampling
+ * method) of the CvParticle. Set it by cvParticleSetXxx( mp->p, ... ).
+ * KLD-sampling (cvParticleSetKld) is not supported because the number
+ * of particles per target is fixed.
+ *
+ * cvCreateMultiParticle
+ * cvParticleSetXxx( mp->p, ... )
+ * cvMultiParticleInit
+ * loop {
+ *   cvMultiParticleTransition
+ *   Measurement
+ *     - cvParticleObserveMeasure( mp->p, ... ) to measure all targets
+ *       at once if they share a frame and an observation model
+ *     - cvParticleObserveMeasure( cvMultiParticleTarget( mp, t ), ... )
+ *       if each target has its own model (e.g., template)
+ *   cvMultiParticleNormalize
+ *   cvParticleGetMean( cvMultiParticleTarget( mp, t ), ... )
+ *   cvMultiParticleResample (or cvMultiParticleResampleIfNeeded)
+ * }
+ * cvReleaseMultiParticle
+ */
+/* The MIT License
+ *
+ * Copyright (c) 2008, Naotoshi Seo <sonots(at)sonots.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef CV_MULTI_PARTICLE_INCLUDED
+#define CV_MULTI_PARTICLE_INCLUDED
+
+#include "cvparticle.h"
+
+/******************************* Constants ***********************************/
+
+#define CV_MULTI_PARTICLE_NUM_HDRS 10 /**< Matrix headers of a target view */
+
+/******************************* Structures **********************************/
+/**
+ * Particle Filter structure for multiple targets
+ */
+typedef struct CvMultiParticle {
+    int num_targets;   /**< Number of targets */
+    int num_particles; /**< Number of particles per target */
+    CvParticle* p;     /**< num_states x (num_targets * num_particles).
+                          Particles of all targets */
+    CvParticle* targets; /**< num_targets. Views of each target.
+                            See cvMultiParticleTarget */
+    CvMat* target_hdrs; /**< Matrix headers of the views */
+} CvMultiParticle;
+
+/**************************** Function Prototypes ****************************/
+
+#ifndef NO_DOXYGEN
+CVAPI(CvMultiParticle*) cvCreateMultiParticle( int num_states, int num_targets,
+                                               int num_particles, bool logweight );
+CVAPI(void) cvReleaseMultiParticle( CvMultiParticle** mp );
+CVAPI(CvParticle*) cvMultiParticleTarget( CvMultiParticle* mp, int t );
+
+CVAPI(void) cvMultiParticleInit( CvMultiParticle* mp, const CvParticle* init, int t );
+CVAPI(void) cvMultiParticleTransition( CvMultiParticle* mp );
+CVAPI(void) cvMultiParticleNormalize( CvMultiParticle* mp );
+CVAPI(void) cvMultiParticleResample( CvMultiParticle* mp );
+CVAPI(int)  cvMultiParticleResampleIfNeeded( CvMultiParticle* mp, double threshold );
+#endif
+
+/*************************** Constructor / Destructor *************************/
+
+/**
+ * Allocate Particle filter structure for multiple targets
+ *
+ * @param num_states    Number of tracking states, e.g., 4 if x, y, width, height
+ * @param num_targets   Number of targets
+ * @param num_particles Number of particles per target
+ * @param logweight     The weights parameter is log  or not
+ * @return CvMultiParticle*
+ */
+CVAPI(CvMultiParticle*) cvCreateMultiParticle( int num_states,
+                                               int num_targets,
+                                               int num_particles,
+                                               bool logweight CV_DEFAULT(false) )
+{
+    CvMultiParticle *mp = NULL;
+    CV_FUNCNAME( "cvCreateMultiParticle" );
+    __BEGIN__;
+    CV_ASSERT( num_targets > 0 );
+    CV_ASSERT( num_particles > 0 );
+    mp = (CvMultiParticle *) cvAlloc( sizeof( CvMultiParticle ) );
+    mp->num_targets   = num_targets;
+    mp->num_particles = num_particles;
+    mp->p             = cvCreateParticle( num_states, num_targets * num_particles, logweight );
+    mp->targets       = (CvParticle *) cvAlloc( num_targets * sizeof( CvParticle ) );
+    mp->target_hdrs   = (CvMat *) cvAlloc( num_targets * CV_MULTI_PARTICLE_NUM_HDRS * sizeof( CvMat ) );
+    __END__;
+    return mp;
+}
+
+/**
+ * Release Particle filter structure for multiple targets
+ *
+ * @param mp
+ */
+CVAPI(void) cvReleaseMultiParticle( CvMultiParticle** mp )
+{
+    CV_FUNCNAME( "cvReleaseMultiParticle" );
+    __BEGIN__;
+    if( !*mp ) EXIT;
+    CV_CALL( cvReleaseParticle( &(*mp)->p ) );
+    CV_CALL( cvFree( &(*mp)->targets ) );
+    CV_CALL( cvFree( &(*mp)->target_hdrs ) );
+    CV_CALL( cvFree( mp ) );
+    __END__;
+}
+
+/***************************** Getter ***************************************/
+
+/**
+ * Get a view of a target as a CvParticle
+ *
+ * The view shares the configuration and the particles with mp->p, so
+ * functions taking a CvParticle such as cvParticleGetMean,
+ * cvParticleGetMax, and observation models work on the target.
+ * The view becomes invalid after cvMultiParticleTransition and
+ * cvMultiParticleResample because they swap buffers. Get it again.
+ * Do not release the view.
+ *
+ * @param mp
+ * @param t     target id
+ * @return CvParticle*
+ */
+CVAPI(CvParticle*) cvMultiParticleTarget( CvMultiParticle* mp, int t )
+{
+    CvParticle* p = mp->p;
+    CvParticle* view = &mp->targets[t];
+    CvMat* hdr = mp->target_hdrs + t * CV_MULTI_PARTICLE_NUM_HDRS;
+    int start = t * mp->num_particles;
+    int end = start + mp->num_particles;
+    *view = *p;
+    view->num_particles = mp->num_particles;
+    view->max_particles = mp->num_particles;
+    view->min_particles = mp->num_particles;
+    view->kld_epsilon   = 0;
+    view->particles     = cvGetCols( p->particles, hdr++, start, end );
+    view->particles_buf = cvGetCols( p->particles_buf, hdr++, start, end );
+    view->noises        = cvGetCols( p->noises, hdr++, start, end );
+    view->weights       = cvGetCols( p->weights, hdr++, start, end );
+    view->mean_ids      = cvGetCols( p->mean_ids, hdr++, start, end );
+    view->cumweights    = cvGetCols( p->cumweights, hdr++, start, end );
+    view->ids           = cvGetCols( p->ids, hdr++, start, end );
+    view->prior_weights = cvGetCols( p->prior_weights, hdr++, start, end );
+    view->duplicates    = cvGetCols( p->duplicates, hdr++, start, end );
+    view->stds          = p->stds ? cvGetCols( p->stds, hdr++, start, end ) : NULL;
+    return view;
+}
+
+/******************* Main (Related to Algorithm) *****************************/
+
+/**
+ * Initialize states of targets
+ *
+ * @param mp
+ * @param init  initial states. See cvParticleInit
+ * @param t     target id. -1 for all targets
+ */
+CVAPI(void) cvMultiParticleInit( CvMultiParticle* mp, const CvParticle* init = NULL,
+                                 int t CV_DEFAULT(-1) )
+{
+    int i;
+    CV_FUNCNAME( "cvMultiParticleInit" );
+    __BEGIN__;
+    CV_ASSERT( mp->p->kld_epsilon == 0 );
+    for( i = 0; i < mp->num_targets; i++ )
+    {
+        if( t >= 0 && i != t ) continue;
+        CvParticle* view = cvMultiParticleTarget( mp, i );
+        cvParticleInit( view, init );
+        mp->p->rng = view->rng; // random state advanced by the view
+        mp->p->rng_frame = view->rng_frame;
+    }
+    __END__;
+}
+
+/**
+ * Samples new particles of all targets
+ *
+ * Noise generation, the dynamics GEMM, and bounding run once for all.
+ *
+ * @param mp
+ * @see cvParticleTransition
+ */
+CVAPI(void) cvMultiParticleTransition( CvMultiParticle* mp )
+{
+    CV_FUNCNAME( "cvMultiParticleTransition" );
+    __BEGIN__;
+    CV_ASSERT( mp->p->kld_epsilon == 0 );
+    CV_CALL( cvParticleTransition( mp->p ) );
+    __END__;
+}
+
+/**
+ * Normalize weights of each target
+ *
+ * Prior weights left by cvMultiParticleResampleIfNeeded are multiplied 
+ * as cvParticleNormalize does. 
+ *
+ * @param mp
+ * @see cvParticleNormalize
+ */
+CVAPI(void) cvMultiParticleNormalize( CvMultiParticle* mp )
+{
+    int t;
+    int64 start = icvParticleProfileBegin( mp->p );
+    CV_FUNCNAME( "cvMultiParticleNormalize" );
+    __BEGIN__;
+    CV_ASSERT( mp->p->kld_epsilon == 0 );
+    for( t = 0; t < mp->num_targets; t++ )
+    {
+        CvParticle* view = cvMultiParticleTarget( mp, t );
+        view->profile = NULL; // profiled once for all targets
+        cvParticleNormalize( view );
+    }
+    mp->p->has_prior = false;
+    icvParticleProfileEnd( mp->p, CV_PARTICLE_PROFILE_NORMALIZE, start );
+    __END__;
+}
+
+/**
+ * Resample targets whose effective sample size has degenerated
+ *
+ * Ids are drawn per target by the resampling method of mp->p, and the
+ * particles of all targets are gathered at once. A target with 
+ * ESS >= threshold * num_particles keeps its particles, and its weights 
+ * are kept as prior weights for cvMultiParticleNormalize. 
+ * The profile records the smallest effective sample size of targets.
+ *
+ * @param mp
+ * @param threshold  Ratio of ESS to num_particles. 1.0 resamples always.
+ * @return number of resampled targets
+ */
+CV_INLINE int icvMultiParticleResample( CvMultiParticle* mp, double threshold )
+{
+    CvParticle* p = mp->p;
+    int n = mp->num_particles;
+    int t, i, resampled = 0;
+    bool always = ( threshold >= 1.0 );
+    double ess = 0;
+    CvMat* tmp;
+    int64 start = icvParticleProfileBegin( p );
+    if( p->profile != NULL )
+        p->profile->ess = DBL_MAX;
+    p->has_prior = false;
+    for( t = 0; t < mp->num_targets; t++ )
+    {
+        int* ids = p->ids->data.i + t * n;
+        double* weights = p->weights->data.db + t * n;
+        double* prior = p->prior_weights->data.db + t * n;
+        if( p->profile != NULL || !always )
+            ess = cvParticleEffectiveSampleSize( cvMultiParticleTarget( mp, t ) );
+        if( p->profile != NULL )
+            p->profile->ess = MIN( p->profile->ess, ess );
+        if( always || ess < threshold * n )
+        {
+            icvParticleResampleIds( &p->rng, p->resample, weights, p->logweight, n, 
+                                    p->cumweights->data.db + t * n, ids, n );
+            for( i = 0; i < n; i++ )
+                ids[i] += t * n;
+            if( !always ) // no prior for this target
+                for( i = 0; i < n; i++ )
+                    prior[i] = p->logweight ? 0.0 : 1.0;
+            resampled++;
+        }
+        else
+        {
+            for( i = 0; i < n; i++ )
+            {
+                ids[i] = t * n + i;
+                prior[i] = weights[i];
+            }
+            p->has_prior = true;
+        }
+    }
+    icvParticleGather( p->particles, p->particles_buf, p->ids->data.i, p->num_particles );
+    CV_SWAP( p->particles, p->particles_buf, tmp );
+    if( p->profile != NULL )
+        p->profile->unique = icvParticleCountUnique( p->ids->data.i, p->num_particles,
+                                                     p->duplicates->data.i, p->num_particles );
+    icvParticleProfileEnd( p, CV_PARTICLE_PROFILE_RESAMPLE, start );
+    return resampled;
+}
+
+/**
+ * Resample particles of each target
+ *
+ * Ids are drawn per target by the resampling method of mp->p, and the
+ * particles of all targets are gathered at once.
+ * The profile records the smallest effective sample size of targets.
+ *
+ * @param mp
+ * @see cvParticleResample
+ */
+CVAPI(void) cvMultiParticleResample( CvMultiParticle* mp )
+{
+    CV_FUNCNAME( "cvMultiParticleResample" );
+    __BEGIN__;
+    CV_ASSERT( mp->p->kld_epsilon == 0 );
+    icvMultiParticleResample( mp, 1.0 );
+    __END__;
+}
+
+/**
+ * Resample only targets whose effective sample size has degenerated
+ *
+ * The effective sample size is computed per target. Targets with 
+ * ESS >= threshold * num_particles keep their particles and weights, 
+ * which cvMultiParticleNormalize multiplies to the next weights. 
+ * Call after cvMultiParticleNormalize instead of cvMultiParticleResample.
+ *
+ * @param mp
+ * @param threshold  Ratio of ESS to num_particles, e.g., 0.5. 
+ *                   1.0 resamples always, 0.0 never. 
+ * @return number of resampled targets
+ * @see cvParticleResampleIfNeeded
+ */
+CVAPI(int) cvMultiParticleResampleIfNeeded( CvMultiParticle* mp, 
+                                            double threshold CV_DEFAULT(0.5) )
+{
+    int resampled = 0;
+    CV_FUNCNAME( "cvMultiParticleResampleIfNeeded" );
+    __BEGIN__;
+    CV_ASSERT( mp->p->kld_epsilon == 0 );
+    resampled = icvMultiParticleResample( mp, threshold );
+    __END__;
+    return resampled;
+}
+
+#endif
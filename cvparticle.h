@@ -8,13 +8,13 @@
  * Other functions should not necessary be modified.
  *
  * cvCreateParticle
- * cvPartcileSetXxx
+ * cvPartcileSetXxx (cvParticleSetResample to choose a resampling method)
  * cvParticleInit
  * loop { 
  *   cvParticleTransition
  *   Measurement
  *   cvParticleNormalize
- *   cvParticleResample
+ *   cvParticleResample (or cvParticleResampleIfNeeded)
  * }
  * cvReleaseParticle
  */
@@ -48,13 +48,62 @@
 #include "cxcore.h"
 
 #include <time.h>
+#include <string.h>
+#include <algorithm>
 #include "cvsetrow.h"
 #include "cvsetcol.h"
 #include "cvlogsum.h"
 #include "cvanglemean.h"
 #include "cvrandgauss.h"
+#include "cvrandphilox.h"
+
+/******************************* Constants ***********************************/
+/**
+ * Resampling methods. See cvParticleSetResample
+ */
+#define CV_PARTICLE_RESAMPLE_ROUND        0 /**< copy round(weight * num) times */
+#define CV_PARTICLE_RESAMPLE_SYSTEMATIC   1 /**< one uniform offset for all */
+#define CV_PARTICLE_RESAMPLE_STRATIFIED   2 /**< one uniform per stratum */
+#define CV_PARTICLE_RESAMPLE_RESIDUAL     3 /**< floor copies + systematic */
+#define CV_PARTICLE_RESAMPLE_MULTINOMIAL  4 /**< i.i.d. draws */
+
+/**
+ * Structures of dynamics found by cvParticleSetDynamics
+ */
+#define CV_PARTICLE_DYNAMICS_DENSE        0 /**< general matrix product */
+#define CV_PARTICLE_DYNAMICS_IDENTITY     1 /**< next = curr */
+#define CV_PARTICLE_DYNAMICS_CONSTVEL     2 /**< [2I, -I; I, 0]. next = curr + (curr - prev) */
+#define CV_PARTICLE_DYNAMICS_SPARSE       3 /**< few non-zeros per row */
+
+#define CV_PARTICLE_BOUND_BLOCK         256 /**< particles bounded at once by cvParticleBound */
+
+#define CV_PARTICLE_SNAPSHOT_MAGIC  "CVPF" /**< first 4 bytes of a snapshot file */
+#define CV_PARTICLE_SNAPSHOT_VERSION    1
+
+/**
+ * Stages timed by cvParticleSetProfile
+ */
+#define CV_PARTICLE_PROFILE_TRANSITION    0 /**< cvParticleTransition (including bounding) */
+#define CV_PARTICLE_PROFILE_BOUND         1 /**< cvParticleBound */
+#define CV_PARTICLE_PROFILE_OBSERVE       2 /**< cvParticleObserveMeasure */
+#define CV_PARTICLE_PROFILE_NORMALIZE     3 /**< cvParticleNormalize */
+#define CV_PARTICLE_PROFILE_RESAMPLE      4 /**< cvParticleResample */
+#define CV_PARTICLE_PROFILE_NUM           5
 
 /******************************* Structures **********************************/
+/**
+ * Counters accumulated by the stages of a particle filter.
+ * See cvParticleSetProfile
+ */
+typedef struct CvParticleProfile {
+    int64 ticks[CV_PARTICLE_PROFILE_NUM]; /**< cvGetTickCount spent in each stage */
+    int calls[CV_PARTICLE_PROFILE_NUM];   /**< Number of calls of each stage */
+    double ess;        /**< Effective sample size of the weights at the 
+                          last resampling */
+    int unique;        /**< Number of distinct particles survived by the 
+                          last resampling */
+} CvParticleProfile;
+
 /**
  * Particle Filter structure
  */
@@ -62,26 +111,95 @@ typedef struct CvParticle {
     // config
     int num_states;    /**< Number of tracking states, e.g.,
                           4 if x, y, width, height */
-    int num_particles; /**< Number of particles */
+    int num_particles; /**< Number of (active) particles. Varies between 
+                          "min_particles" and "max_particles" per frame 
+                          if KLD-sampling is enabled. */
+    int max_particles; /**< Number of allocated particles */
     bool logweight;    /**< log weights are stored in "weights". */
     // transition
     CvMat* dynamics;   /**< num_states x num_states. Dynamics model. */
+    int dynamics_type; /**< CV_PARTICLE_DYNAMICS_*. Structure of "dynamics" */
+    const uchar* dynamics_data; /**< "dynamics->data" when "dynamics_type" 
+                                   was found */
+    uint64 dynamics_hash; /**< Hash of "dynamics" when "dynamics_type" 
+                             was found. cvParticleTransition finds it again 
+                             if "dynamics" was modified directly */
+    CvMat* dynamics_rows; /**< 1 x (num_states + 1), CV_32SC1. Start of 
+                             non-zeros of each row (CSR) for sparse dynamics */
+    CvMat* dynamics_cols; /**< 1 x num_states^2, CV_32SC1. Column of non-zeros */
+    CvMat* dynamics_vals; /**< 1 x num_states^2. Value of non-zeros */
     CvRNG  rng;        /**< Random seed */
     CvMat* std;        /**< num_states x 1. Standard deviation for gaussian noise
                           Set standard deviation == 0 for no noise */
-    CvMat* stds;       /**< num_states x num_particles. 
-                          Std for each particle so that you could be varying 
-                          noise variance for each particle.
+    CvMat* stds;       /**< num_states x max_particles, CV_32FC1 (the type of 
+                          "noises"). Std for each particle so that you could be 
+                          varying noise variance for each particle.
                           "std" is used if "stds" is not set. */
     CvMat* bound;      /**< num_states x 3 (lowerbound, upperbound, 
                           wrap_around (like angle) flag 0 or 1)
                           Set lowerbound == upperbound to express no bound */
+    CvMat* bound_linear; /**< num_states x 3 (reference state, coefficient, 
+                            offset). state <= offset + coefficient * reference.
+                            Reference -1 to express no bound. 
+                            See cvParticleSetBoundLinear */
+    // resampling
+    int resample;      /**< Resampling method, CV_PARTICLE_RESAMPLE_* */
+    // KLD-sampling (adaptive number of particles)
+    double kld_epsilon; /**< Error bound of KLD-sampling. 0 disables it */
+    double kld_z;      /**< Upper 1 - delta quantile of standard normal */
+    int min_particles; /**< Lower limit of num_particles for KLD-sampling */
+    CvMat* kld_binsize; /**< num_states x 1. Histogram bin size of each state.
+                           <= 0 to ignore the state. NULL if not set. */
+    CvMat* kld_table;  /**< 1 x (power of 2 >= 2 * max_particles), CV_32SC1.
+                          Hash table of occupied bins */
     // particle states
-    CvMat* particles;  /**< num_states x num_particles. The particles. 
-                          The transition states values of all particles. */
-    CvMat* weights;    /**< 1 x num_particles. The weights of 
+    // Matrices sized by num_particles are allocated for max_particles. 
+    // Their cols are set to num_particles so that they are views of
+    // the active particles (non-continuous if num_particles < max_particles).
+    CvMat* particles;  /**< num_states x num_particles, CV_32FC1. The particles. 
+                          The transition states values of all particles. 
+                          Values of a state are contiguous in a row. */
+    CvMat* weights;    /**< 1 x num_particles, CV_64FC1. The weights of 
                           each particle respect to the particle id in "particles". 
                           "weights" are used to approximated the posterior pdf. */
+    // workspace (reused every frame so that no heap allocation occurs)
+    CvMat* particles_buf; /**< num_states x num_particles. Back buffer of 
+                             "particles". Swapped with "particles" rather than 
+                             reallocated by transition and resampling. */
+    CvMat* noises;     /**< num_states x num_particles. Scratch for noises */
+    CvMat* mean_ids;   /**< 1 x num_particles, CV_32SC1. Scratch for top_k 
+                          of cvParticleGetMean */
+    CvMat* cumweights; /**< 1 x num_particles. Scratch for cumulative weights */
+    CvMat* ids;        /**< 1 x num_particles, CV_32SC1. Scratch for ids of 
+                          particles survived by resampling */
+    // adaptive resampling
+    CvMat* prior_weights; /**< 1 x num_particles. Normalized weights kept by 
+                             cvParticleResampleIfNeeded when it skipped 
+                             resampling. Multiplied into the next weights 
+                             by cvParticleNormalize. */
+    bool has_prior;    /**< "prior_weights" are valid or not */
+    // likelihood cache for duplicated particles
+    CvMat* cache_tol;  /**< num_states x 1. Quantization step of each state 
+                          to regard particles as identical. 0 for exact match,
+                          < 0 to ignore the state. NULL if cache is disabled. */
+    CvMat* cache_table; /**< 1 x (power of 2 >= 2 * max_particles), CV_32SC1.
+                           Hash table of quantized states */
+    CvMat* duplicates; /**< 1 x num_particles, CV_32SC1. Id of the particle 
+                          whose likelihood is reused (its own id if measured) */
+    int cache_hits;    /**< Number of particles whose likelihood was reused */
+    int cache_misses;  /**< Number of particles measured */
+    // counter-based random numbers
+    bool counter_rng;  /**< Draw random numbers of cvParticleInit and 
+                          cvParticleTransition by Philox keyed on 
+                          (rng_seed, rng_frame, particle, state) instead 
+                          of "rng". Results do not depend on the number 
+                          of threads. See cvParticleSetCounterRng */
+    uint64 rng_seed;   /**< Key of counter-based random numbers */
+    unsigned int rng_frame; /**< Counter incremented by each cvParticleInit 
+                               and cvParticleTransition */
+    // instrumentation
+    CvParticleProfile* profile; /**< Per-stage counters. NULL if disabled. 
+                                   See cvParticleSetProfile */
 } CvParticle;
 
 /**************************** Function Prototypes ****************************/
@@ -89,21 +207,39 @@ typedef struct CvParticle {
 #ifndef NO_DOXYGEN
 CVAPI(CvParticle*) cvCreateParticle( int num_states, int num_particles, bool logweight );
 CVAPI(void) cvReleaseParticle( CvParticle** p );
+CVAPI(void) cvSaveParticle( const char* filename, const CvParticle* p );
+CVAPI(CvParticle*) cvLoadParticle( const char* filename );
 
 CVAPI(void) cvParticleSetDynamics( CvParticle* p, const CvMat* dynamics );
 CVAPI(void) cvParticleSetNoise( CvParticle* p, CvRNG rng, const CvMat* std );
 CVAPI(void) cvParticleSetBound( CvParticle* p, const CvMat* bound );
+CVAPI(void) cvParticleSetBoundLinear( CvParticle* p, int s, int ref, 
+                                      double coeff, double offset );
+CVAPI(void) cvParticleSetResample( CvParticle* p, int method );
+CVAPI(void) cvParticleSetKld( CvParticle* p, int min_particles, double epsilon,
+                              double delta, const CvMat* binsize );
+CVAPI(void) cvParticleSetCache( CvParticle* p, const CvMat* tol );
+CVAPI(void) cvParticleSetCounterRng( CvParticle* p, uint64 seed, bool enable );
+CVAPI(void) cvParticleSetProfile( CvParticle* p, bool enable );
 
 CVAPI(int)  cvParticleGetMax( const CvParticle* p );
-CVAPI(void) cvParticleGetMean( const CvParticle* p, CvMat* meanp );
+CVAPI(void) cvParticleGetMean( const CvParticle* p, CvMat* meanp, int top_k );
 CVAPI(void) cvParticlePrint( const CvParticle* p, int p_id );
+CVAPI(double) cvParticleProfileMsec( const CvParticle* p, int stage );
+CVAPI(void) cvParticlePrintProfile( const CvParticle* p );
 
 CVAPI(void) cvParticleBound( CvParticle* p );
 CVAPI(void) cvParticleNormalize( CvParticle* p );
+CVAPI(double) cvParticleEffectiveSampleSize( const CvParticle* p );
+CVAPI(int)  cvParticleFindDuplicates( CvParticle* p );
+CVAPI(void) cvParticleCopyDuplicates( CvParticle* p );
+CVAPI(int)  cvParticleCascadeSelect( const double* scores, int n, double keep_ratio, 
+                                     double threshold, int* order );
 
 CVAPI(void) cvParticleInit( CvParticle* p, const CvParticle* init );
 CVAPI(void) cvParticleTransition( CvParticle* p );
 CVAPI(void) cvParticleResample( CvParticle* p );
+CVAPI(int)  cvParticleResampleIfNeeded( CvParticle* p, double threshold );
 #endif
 
 /*************************** Constructor / Destructor *************************/
@@ -127,21 +263,54 @@ CVAPI(CvParticle*) cvCreateParticle( int num_states,
     CV_ASSERT( num_particles > 0 );
     p = (CvParticle *) cvAlloc( sizeof( CvParticle ) );
     p->num_particles = num_particles;
+    p->max_particles = num_particles;
     p->num_states    = num_states;
     p->dynamics      = cvCreateMat( num_states, num_states, CV_32FC1 );
+    p->dynamics_type = CV_PARTICLE_DYNAMICS_IDENTITY;
+    p->dynamics_data = NULL; // analyzed by the first cvParticleTransition
+    p->dynamics_hash = 0;
+    p->dynamics_rows = cvCreateMat( 1, num_states + 1, CV_32SC1 );
+    p->dynamics_cols = cvCreateMat( 1, num_states * num_states, CV_32SC1 );
+    p->dynamics_vals = cvCreateMat( 1, num_states * num_states, CV_32FC1 );
     p->rng           = 1;
     p->std           = cvCreateMat( num_states, 1, CV_32FC1 );
     p->bound         = cvCreateMat( num_states, 3, CV_32FC1 );
+    p->bound_linear  = cvCreateMat( num_states, 3, CV_32FC1 );
     p->particles     = cvCreateMat( num_states, num_particles, CV_32FC1 );
     p->weights       = cvCreateMat( 1, num_particles, CV_64FC1 );
     p->logweight     = logweight;
     p->stds          = NULL;
+    p->particles_buf = cvCreateMat( num_states, num_particles, CV_32FC1 );
+    p->noises        = cvCreateMat( num_states, num_particles, CV_32FC1 );
+    p->mean_ids      = cvCreateMat( 1, num_particles, CV_32SC1 );
+    p->cumweights    = cvCreateMat( 1, num_particles, CV_64FC1 );
+    p->ids           = cvCreateMat( 1, num_particles, CV_32SC1 );
+    p->resample      = CV_PARTICLE_RESAMPLE_ROUND;
+    p->prior_weights = cvCreateMat( 1, num_particles, CV_64FC1 );
+    p->has_prior     = false;
+    p->kld_epsilon   = 0;
+    p->kld_z         = 0;
+    p->min_particles = num_particles;
+    p->kld_binsize   = NULL;
+    p->kld_table     = NULL;
+    p->cache_tol     = NULL;
+    p->cache_table   = NULL;
+    p->duplicates    = cvCreateMat( 1, num_particles, CV_32SC1 );
+    p->cache_hits    = 0;
+    p->cache_misses  = 0;
+    p->counter_rng   = false;
+    p->rng_seed      = 0;
+    p->rng_frame     = 0;
+    p->profile       = NULL;
 
     // Default dynamics: next state = curr state + noise
     cvSetIdentity( p->dynamics, cvScalar(1.0) );
     cvSet( p->std, cvScalar(1.0) );
 
     cvZero( p->bound );
+    cvZero( p->bound_linear );
+    for( int s = 0; s < num_states; s++ )
+        cvmSet( p->bound_linear, s, 0, -1 );
 
     __END__;
     return p;
@@ -161,12 +330,33 @@ CVAPI(void) cvReleaseParticle( CvParticle** particle )
     if( !p ) EXIT;
     
     CV_CALL( cvReleaseMat( &p->dynamics ) );
+    CV_CALL( cvReleaseMat( &p->dynamics_rows ) );
+    CV_CALL( cvReleaseMat( &p->dynamics_cols ) );
+    CV_CALL( cvReleaseMat( &p->dynamics_vals ) );
     CV_CALL( cvReleaseMat( &p->std ) );
     CV_CALL( cvReleaseMat( &p->bound ) );
+    CV_CALL( cvReleaseMat( &p->bound_linear ) );
     CV_CALL( cvReleaseMat( &p->particles ) );
     CV_CALL( cvReleaseMat( &p->weights ) );
     if( p->stds != NULL )
         CV_CALL( cvReleaseMat( &p->stds ) );
+    CV_CALL( cvReleaseMat( &p->particles_buf ) );
+    CV_CALL( cvReleaseMat( &p->noises ) );
+    CV_CALL( cvReleaseMat( &p->mean_ids ) );
+    CV_CALL( cvReleaseMat( &p->cumweights ) );
+    CV_CALL( cvReleaseMat( &p->ids ) );
+    CV_CALL( cvReleaseMat( &p->prior_weights ) );
+    if( p->kld_binsize != NULL )
+        CV_CALL( cvReleaseMat( &p->kld_binsize ) );
+    if( p->kld_table != NULL )
+        CV_CALL( cvReleaseMat( &p->kld_table ) );
+    if( p->cache_tol != NULL )
+        CV_CALL( cvReleaseMat( &p->cache_tol ) );
+    if( p->cache_table != NULL )
+        CV_CALL( cvReleaseMat( &p->cache_table ) );
+    CV_CALL( cvReleaseMat( &p->duplicates ) );
+    if( p->profile != NULL )
+        CV_CALL( cvFree( &p->profile ) );
 
     CV_CALL( cvFree( &p ) );
     __END__;
@@ -174,9 +364,76 @@ CVAPI(void) cvReleaseParticle( CvParticle** particle )
 
 /***************************** Setter ***************************************/
 
+/**
+ * Hash of a dynamics matrix (FNV-1a over its elements)
+ */
+CV_INLINE uint64 icvParticleDynamicsHash( const CvMat* dynamics )
+{
+    uint64 hash = CV_BIG_UINT( 14695981039346656037 );
+    for( int i = 0; i < dynamics->rows; i++ )
+    {
+        const uchar* row = dynamics->data.ptr + dynamics->step * i;
+        for( int j = 0; j < dynamics->cols * (int)sizeof( float ); j++ )
+            hash = ( hash ^ row[j] ) * CV_BIG_UINT( 1099511628211 );
+    }
+    return hash;
+}
+
+/**
+ * Find the structure of p->dynamics
+ *
+ * Sets dynamics_type, the non-zeros for sparse dynamics, and the 
+ * data pointer and hash by which cvParticleTransition notices 
+ * direct modifications of p->dynamics.
+ */
+CV_INLINE void icvParticleAnalyzeDynamics( CvParticle* p )
+{
+    int S = p->num_states;
+    int i, j, nnz = 0, half = S / 2;
+    bool identity = true, constvel = ( S % 2 == 0 );
+    float v, expect;
+    for( i = 0; i < S; i++ )
+    {
+        p->dynamics_rows->data.i[i] = nnz;
+        for( j = 0; j < S; j++ )
+        {
+            v = CV_MAT_ELEM( *p->dynamics, float, i, j );
+            if( v != ( i == j ? 1.0f : 0.0f ) ) identity = false;
+            if( i < half )
+                expect = ( j == i ) ? 2.0f : ( j == i + half ) ? -1.0f : 0.0f;
+            else
+                expect = ( j == i - half ) ? 1.0f : 0.0f;
+            if( v != expect ) constvel = false;
+            if( v != 0 )
+            {
+                p->dynamics_cols->data.i[nnz] = j;
+                p->dynamics_vals->data.fl[nnz] = v;
+                nnz++;
+            }
+        }
+    }
+    p->dynamics_rows->data.i[S] = nnz;
+    if( identity )
+        p->dynamics_type = CV_PARTICLE_DYNAMICS_IDENTITY;
+    else if( constvel )
+        p->dynamics_type = CV_PARTICLE_DYNAMICS_CONSTVEL;
+    else if( nnz <= 2 * S )
+        p->dynamics_type = CV_PARTICLE_DYNAMICS_SPARSE;
+    else
+        p->dynamics_type = CV_PARTICLE_DYNAMICS_DENSE;
+    p->dynamics_data = p->dynamics->data.ptr;
+    p->dynamics_hash = icvParticleDynamicsHash( p->dynamics );
+}
+
 /**
  * Set dynamics model
  *
+ * The structure of the dynamics is analyzed here so that 
+ * cvParticleTransition runs a kernel of O(num_states * num_particles) 
+ * for identity, constant velocity ([2I, -I; I, 0]), and sparse dynamics 
+ * instead of the dense matrix product. If p->dynamics is modified 
+ * directly, cvParticleTransition analyzes it again. 
+ *
  * @param particle
  * @param dynamics (num_states) x (num_states). dynamics model
  *    new_state = dynamics * curr_state + noise
@@ -189,6 +446,7 @@ CVAPI(void) cvParticleSetDynamics( CvParticle* p, const CvMat* dynamics )
     CV_ASSERT( p->num_states == dynamics->cols );
     //cvCopy( dynamics, p->dynamics );
     cvConvert( dynamics, p->dynamics );
+    icvParticleAnalyzeDynamics( p );
     __END__;
 }
 
@@ -229,8 +487,343 @@ CVAPI(void) cvParticleSetBound( CvParticle* p, const CvMat* bound )
     __END__;
 }
 
+/**
+ * Set an upper bound of a state which is linear in another state
+ *
+ * state[s] <= offset + coeff * state[ref] is applied by cvParticleBound 
+ * after the bounds of cvParticleSetBound, e.g., 
+ * cvParticleSetBoundLinear( p, 2, 0, -1, imsize.width ) keeps 
+ * x + width <= imsize.width for states (x, y, width, ...). 
+ * One bound per state. 
+ *
+ * @param particle
+ * @param s        state id to be bounded
+ * @param ref      reference state id. -1 removes the bound of s
+ * @param coeff    coefficient of the reference state
+ * @param offset   offset
+ */
+CVAPI(void) cvParticleSetBoundLinear( CvParticle* p, int s, int ref, 
+                                      double coeff, double offset )
+{
+    CV_FUNCNAME( "cvParticleSetBoundLinear" );
+    __BEGIN__;
+    CV_ASSERT( 0 <= s && s < p->num_states );
+    CV_ASSERT( -1 <= ref && ref < p->num_states && ref != s );
+    cvmSet( p->bound_linear, s, 0, ref );
+    cvmSet( p->bound_linear, s, 1, coeff );
+    cvmSet( p->bound_linear, s, 2, offset );
+    __END__;
+}
+
+/**
+ * Set resampling method used by cvParticleResample
+ *
+ * @param particle
+ * @param method   CV_PARTICLE_RESAMPLE_ROUND (default) - copy each particle 
+ *                   round(weight * num_particles) times and fill the rest
+ *                   with the most probable particle. Deterministic but biased.
+ *                 CV_PARTICLE_RESAMPLE_SYSTEMATIC - one random offset, 
+ *                   num_particles evenly spaced pointers. 
+ *                 CV_PARTICLE_RESAMPLE_STRATIFIED - one random pointer 
+ *                   in each of num_particles strata. 
+ *                 CV_PARTICLE_RESAMPLE_RESIDUAL - floor(weight * num_particles)
+ *                   copies, the rest by systematic resampling of residuals.
+ *                 CV_PARTICLE_RESAMPLE_MULTINOMIAL - i.i.d. draws.
+ */
+CVAPI(void) cvParticleSetResample( CvParticle* p, int method )
+{
+    CV_FUNCNAME( "cvParticleSetResample" );
+    __BEGIN__;
+    CV_ASSERT( method >= CV_PARTICLE_RESAMPLE_ROUND && 
+               method <= CV_PARTICLE_RESAMPLE_MULTINOMIAL );
+    p->resample = method;
+    __END__;
+}
+
+/**
+ * Upper quantile of the standard normal distribution
+ *
+ * Rational approximation of Abramowitz and Stegun 26.2.23 
+ * (absolute error < 4.5e-4).
+ *
+ * @param q   upper tail probability (0 < q < 1)
+ * @return z such that P(Z > z) = q
+ */
+CV_INLINE double icvNormalUpperQuantile( double q )
+{
+    double t, z;
+    bool lower = q > 0.5;
+    if( lower ) q = 1.0 - q;
+    t = sqrt( -2.0 * log( q ) );
+    z = t - ( 2.515517 + 0.802853 * t + 0.010328 * t * t ) / 
+        ( 1.0 + 1.432788 * t + 0.189269 * t * t + 0.001308 * t * t * t );
+    return lower ? -z : z;
+}
+
+/**
+ * Set the number of active particles
+ *
+ * Matrices sized by num_particles become views of their first 
+ * num_particles columns. No memory is reallocated. 
+ *
+ * @param particle
+ * @param num_particles  1 <= num_particles <= max_particles
+ */
+CV_INLINE void icvParticleSetActive( CvParticle* p, int num_particles )
+{
+    int i;
+    CvMat* mats[] = { p->particles, p->particles_buf, p->noises, p->weights, 
+                      p->mean_ids, p->cumweights, p->ids, p->prior_weights,
+                      p->duplicates };
+    for( i = 0; i < (int)( sizeof( mats ) / sizeof( mats[0] ) ); i++ )
+    {
+        mats[i]->cols = num_particles;
+        if( mats[i]->rows == 1 || 
+            mats[i]->step == num_particles * CV_ELEM_SIZE( mats[i]->type ) )
+            mats[i]->type |= CV_MAT_CONT_FLAG;
+        else
+            mats[i]->type &= ~CV_MAT_CONT_FLAG;
+    }
+    p->num_particles = num_particles;
+}
+
+/**
+ * Set KLD-sampling by the upper quantile z of delta
+ *
+ * @see cvParticleSetKld
+ */
+CV_INLINE void icvParticleSetKld( CvParticle* p, int min_particles, double epsilon,
+                                  double z, const CvMat* binsize )
+{
+    int size = 1;
+    p->min_particles = min_particles;
+    p->kld_epsilon   = epsilon;
+    p->kld_z         = z;
+    if( p->kld_binsize == NULL )
+        p->kld_binsize = cvCreateMat( p->num_states, 1, CV_64FC1 );
+    cvConvert( binsize, p->kld_binsize );
+    if( p->kld_table == NULL )
+    {
+        while( size < 2 * p->max_particles ) size *= 2;
+        p->kld_table = cvCreateMat( 1, size, CV_32SC1 );
+    }
+}
+
+/**
+ * Enable KLD-sampling [1]
+ *
+ * The number of particles is adapted at every cvParticleResample so that
+ * the K-L divergence between the sample-based approximation and the true 
+ * posterior does not exceed epsilon with probability 1 - delta. The 
+ * required number is determined by the number of histogram bins occupied 
+ * by the drawn particles. Particles are drawn by multinomial sampling 
+ * regardless of cvParticleSetResample. 
+ * 
+ * The initial num_particles (given to cvCreateParticle) is the upper limit.
+ *
+ * @param particle
+ * @param min_particles  Lower limit of the number of particles
+ * @param epsilon        Error bound, e.g., 0.05. 0 disables KLD-sampling. 
+ * @param delta          Probability bound, e.g., 0.01
+ * @param binsize        num_states x 1. Bin size of each state for the 
+ *                       histogram. Set <= 0 to ignore a state, 
+ *                       e.g., velocity states. 
+ *
+ * References
+ * @verbatim
+ *   [1] @ARTICLE{Fox03adaptingthe,
+ *     author = {Dieter Fox},
+ *     title = {Adapting the sample size in particle filters through KLD-sampling},
+ *     journal = {International Journal of Robotics Research},
+ *     year = {2003},
+ *     volume = {22},
+ *     pages = {985--1003}
+ *   }
+ * @endverbatim
+ */
+CVAPI(void) cvParticleSetKld( CvParticle* p, int min_particles, double epsilon,
+                              double delta, const CvMat* binsize )
+{
+    CV_FUNCNAME( "cvParticleSetKld" );
+    __BEGIN__;
+    CV_ASSERT( 0 < min_particles && min_particles <= p->max_particles );
+    CV_ASSERT( epsilon >= 0 );
+    if( epsilon == 0 ) // disable
+    {
+        p->kld_epsilon = 0;
+        icvParticleSetActive( p, p->max_particles );
+        EXIT;
+    }
+    CV_ASSERT( 0 < delta && delta < 1 );
+    CV_ASSERT( binsize != NULL && binsize->rows == p->num_states && binsize->cols == 1 );
+    icvParticleSetKld( p, min_particles, epsilon, icvNormalUpperQuantile( delta ), binsize );
+    __END__;
+}
+
+/**
+ * Enable likelihood cache for duplicated particles
+ *
+ * Resampling copies a particle many times, and states with no noise stay 
+ * identical after transition. If the cache is enabled, observation models 
+ * measure only one of particles having the same quantized states and 
+ * reuse its likelihood for the others. 
+ *
+ * @param particle
+ * @param tol      num_states x 1. Quantization step of each state, e.g., 
+ *                 1 pixel for x, y, width, height and 1 degree for angle.
+ *                 0 for exact match, < 0 to ignore the state (e.g., velocity
+ *                 states which do not affect observation). 
+ *                 NULL disables the cache. 
+ * @see cvParticleFindDuplicates
+ */
+CVAPI(void) cvParticleSetCache( CvParticle* p, const CvMat* tol )
+{
+    int size = 1;
+    CV_FUNCNAME( "cvParticleSetCache" );
+    __BEGIN__;
+    if( tol == NULL )
+    {
+        if( p->cache_tol != NULL )
+            cvReleaseMat( &p->cache_tol );
+        EXIT;
+    }
+    CV_ASSERT( tol->rows == p->num_states && tol->cols == 1 );
+    if( p->cache_tol == NULL )
+        p->cache_tol = cvCreateMat( p->num_states, 1, CV_64FC1 );
+    cvConvert( tol, p->cache_tol );
+    if( p->cache_table == NULL )
+    {
+        while( size < 2 * p->max_particles ) size *= 2;
+        p->cache_table = cvCreateMat( 1, size, CV_32SC1 );
+    }
+    __END__;
+}
+
+/**
+ * Use counter-based random numbers
+ *
+ * Noises of cvParticleTransition and random states of cvParticleInit 
+ * become a function of (seed, frame, particle, state) by Philox4x32-10, 
+ * so that they are generated in parallel (OpenMP) and reproduced 
+ * bit-identically regardless of the number of threads. 
+ * Resampling still uses "rng" sequentially. 
+ *
+ * @param particle
+ * @param seed      key of random numbers
+ * @param enable    false to go back to "rng"
+ * @see cvrandphilox.h
+ */
+CVAPI(void) cvParticleSetCounterRng( CvParticle* p, uint64 seed, 
+                                     bool enable CV_DEFAULT(true) )
+{
+    CV_FUNCNAME( "cvParticleSetCounterRng" );
+    __BEGIN__;
+    CV_ASSERT( p != NULL );
+    p->counter_rng = enable;
+    p->rng_seed    = seed;
+    p->rng_frame   = 0;
+    __END__;
+}
+
+/**
+ * Enable per-stage instrumentation
+ *
+ * Wall time and the number of calls of cvParticleTransition, 
+ * cvParticleBound, cvParticleObserveMeasure, cvParticleNormalize, and 
+ * cvParticleResample are accumulated into p->profile, and the effective 
+ * sample size and the number of distinct survivors are recorded by 
+ * cvParticleResample. Enabling again resets the counters. 
+ * When disabled (default), a stage only tests p->profile for NULL. 
+ *
+ * @param particle
+ * @param enable    false to disable and free the counters
+ * @see cvParticleProfileMsec
+ */
+CVAPI(void) cvParticleSetProfile( CvParticle* p, bool enable CV_DEFAULT(true) )
+{
+    CV_FUNCNAME( "cvParticleSetProfile" );
+    __BEGIN__;
+    CV_ASSERT( p != NULL );
+    if( !enable )
+    {
+        if( p->profile != NULL )
+            CV_CALL( cvFree( &p->profile ) );
+        EXIT;
+    }
+    if( p->profile == NULL )
+        CV_CALL( p->profile = (CvParticleProfile *) cvAlloc( sizeof( CvParticleProfile ) ) );
+    memset( p->profile, 0, sizeof( CvParticleProfile ) );
+    __END__;
+}
+
+/**
+ * Start timing a stage
+ *
+ * @param particle
+ * @return start tick. 0 if instrumentation is disabled
+ */
+CV_INLINE int64 icvParticleProfileBegin( const CvParticle* p )
+{
+    return p->profile != NULL ? cvGetTickCount() : 0;
+}
+
+/**
+ * Stop timing a stage
+ *
+ * @param particle
+ * @param stage     CV_PARTICLE_PROFILE_*
+ * @param start     start tick by icvParticleProfileBegin
+ */
+CV_INLINE void icvParticleProfileEnd( CvParticle* p, int stage, int64 start )
+{
+    if( p->profile == NULL ) return;
+    p->profile->ticks[stage] += cvGetTickCount() - start;
+    p->profile->calls[stage]++;
+}
+
 /************************ Utility ******************************************/
 
+/**
+ * Get the first S states of a particle
+ *
+ * Each state is read directly from its row of "particles" 
+ * rather than through a CvMat column header and cvmGet. 
+ * This is only an accessor; transition and bounding still run
+ * on the runtime num_states.
+ *
+ * @param particle
+ * @param p_id      particle id
+ * @param states    S. output states. S <= num_states
+ * @see cvParticleStateGet in cvparticle/state1.h
+ */
+template<int S, typename T>
+inline void cvParticleGetStates( const CvParticle* p, int p_id, T* states )
+{
+    assert( S <= p->num_states && p_id >= 0 && p_id < p->num_particles );
+    const uchar* ptr = p->particles->data.ptr + p_id * sizeof( float );
+    int step = p->particles->step;
+    for( int s = 0; s < S; s++ )
+        states[s] = (T)*(const float*)( ptr + step * s );
+}
+
+/**
+ * Set the first S states of a particle
+ *
+ * @param particle
+ * @param p_id      particle id
+ * @param states    S. states. S <= num_states
+ * @see cvParticleGetStates
+ */
+template<int S, typename T>
+inline void cvParticleSetStates( CvParticle* p, int p_id, const T* states )
+{
+    assert( S <= p->num_states && p_id >= 0 && p_id < p->num_particles );
+    uchar* ptr = p->particles->data.ptr + p_id * sizeof( float );
+    int step = p->particles->step;
+    for( int s = 0; s < S; s++ )
+        *(float*)( ptr + step * s ) = (float)states[s];
+}
+
 /**
  * Get id of the most probable particle
  *
@@ -245,55 +838,145 @@ CVAPI(int) cvParticleGetMax( const CvParticle* p )
     return max_loc.x;
 }
 
+/**
+ * Orders particle ids by descending weights
+ */
+struct icvParticleWeightGreater {
+    const double* w;
+    icvParticleWeightGreater( const double* _w ) : w( _w ) {}
+    bool operator()( int a, int b ) const { return w[a] > w[b]; }
+};
+
+/**
+ * Accumulate weighted states for icvParticleMean
+ *
+ * @param uniform   use weight 1 for all particles
+ * @return sum of weights
+ */
+CV_INLINE double icvParticleMeanAccumulate( const CvParticle* p, const int* ids, int n, 
+                                            double maxval, bool uniform, 
+                                            const double* lower, const double* scale, 
+                                            double* sum, double* sumcos, double* sumsin )
+{
+    int S = p->num_states, i, j;
+    const double* weights = p->weights->data.db;
+    double sumw = 0, w, theta;
+    for( i = 0; i < S; i++ )
+        sum[i] = sumcos[i] = sumsin[i] = 0;
+    for( j = 0; j < n; j++ )
+    {
+        int id = ids == NULL ? j : ids[j];
+        w = uniform ? 1.0 : p->logweight ? exp( weights[id] - maxval ) : weights[id];
+        sumw += w;
+        for( i = 0; i < S; i++ )
+        {
+            // a state row is contiguous
+            float state = ((const float*)( p->particles->data.ptr + p->particles->step * i ))[id];
+            if( scale[i] == 0 )
+                sum[i] += state * w;
+            else // circular mean: angle of the weighted mean of unit vectors
+            {
+                theta = ( state - lower[i] ) * scale[i];
+                sumcos[i] += cos( theta ) * w;
+                sumsin[i] += sin( theta ) * w;
+            }
+        }
+    }
+    return sumw;
+}
+
+/**
+ * Weighted mean of states
+ *
+ * Weights are read once per particle. Log weights are taken exp 
+ * relative to maxval on the fly, so no buffer is needed. 
+ * If linear weights sum to 0, the plain average is returned.
+ *
+ * @param particle
+ * @param ids       ids of particles to be used. NULL for the first n
+ * @param n         number of particles to be used
+ * @param maxval    max of log weights. Ignored for linear weights
+ * @param mean      num_states. output
+ */
+CV_INLINE void icvParticleMean( const CvParticle* p, const int* ids, int n, 
+                                double maxval, double* mean )
+{
+    int S = p->num_states, i;
+    double* lower = (double*)cvStackAlloc( 5 * S * sizeof( double ) );
+    double* scale = lower + S;
+    double* sum = scale + S, *sumcos = sum + S, *sumsin = sumcos + S;
+    double sumw;
+    for( i = 0; i < S; i++ )
+    {
+        double wrap = cvmGet( p->bound, i, 2 ) ? cvmGet( p->bound, i, 1 ) - cvmGet( p->bound, i, 0 ) : 0;
+        lower[i] = cvmGet( p->bound, i, 0 );
+        scale[i] = wrap > 0 ? 2 * CV_PI / wrap : 0; // 0 for usual mean
+    }
+    sumw = icvParticleMeanAccumulate( p, ids, n, maxval, false, lower, scale, 
+                                      sum, sumcos, sumsin );
+    if( sumw == 0 ) // no particle has weight. plain average rather than NaN
+        sumw = icvParticleMeanAccumulate( p, ids, n, maxval, true, lower, scale, 
+                                          sum, sumcos, sumsin );
+    for( i = 0; i < S; i++ )
+    {
+        if( scale[i] == 0 )
+            mean[i] = sum[i] / sumw;
+        else
+        {
+            double angle = atan2( sumsin[i], sumcos[i] ) / scale[i];
+            mean[i] = lower[i] + ( angle < 0 ? angle + 2 * CV_PI / scale[i] : angle );
+        }
+    }
+}
+
 /**
  * Get the mean state (particle)
  *
+ * States with the wrap around flag of cvParticleSetBound (such as angle) 
+ * are averaged as angles, e.g., the mean of 358 and 2 becomes 0. 
+ * No memory is allocated. top_k uses p->mean_ids as scratch, so do not 
+ * call this function for the same particle filter from threads at once.
+ *
  * @param particle
  * @param meanp     num_states x 1, CV_32FC1 or CV_64FC1
+ * @param top_k     Use only top_k particles of the largest weights 
+ *                  (weights are renormalized among them). 
+ *                  1 gives the maximum a posteriori (MAP) particle. 
+ *                  0 (default) uses all particles. 
  * @return CVAPI(void)
  */
-CVAPI(void) cvParticleGetMean( const CvParticle* p, CvMat* meanp )
+CVAPI(void) cvParticleGetMean( const CvParticle* p, CvMat* meanp, 
+                               int top_k CV_DEFAULT(0) )
 {
-    CvMat* weights = NULL;
-    CvMat* particles_i, hdr;
+    const double* weights = p->weights->data.db;
+    int* ids = NULL;
+    int n = p->num_particles;
     int i, j;
+    double maxval = -DBL_MAX;
+    double* mean = (double*)cvStackAlloc( p->num_states * sizeof( double ) );
     CV_FUNCNAME( "cvParticleGetMean" );
     __BEGIN__;
     CV_ASSERT( meanp->rows == p->num_states && meanp->cols == 1 );
-    if( !p->logweight )
+    CV_ASSERT( CV_MAT_TYPE( p->particles->type ) == CV_32FC1 );
+
+    // the order of log weights is the same as linear weights
+    if( top_k > 0 && top_k < n )
     {
-        weights = p->weights;
+        ids = p->mean_ids->data.i;
+        for( j = 0; j < n; j++ )
+            ids[j] = j;
+        std::nth_element( ids, ids + top_k - 1, ids + n, icvParticleWeightGreater( weights ) );
+        n = top_k;
     }
-    else
+    if( p->logweight ) // exp relative to the max so that weights need not to be normalized
     {
-        weights = cvCreateMat( 1, p->num_particles, p->weights->type );
-        cvExp( p->weights, weights );
+        for( j = 0; j < n; j++ )
+            maxval = MAX( maxval, weights[ids == NULL ? j : ids[j]] );
     }
 
+    icvParticleMean( p, ids, n, maxval, mean );
     for( i = 0; i < p->num_states; i++ )
-    {
-        int circular = (int) cvmGet( p->bound, i, 2 );
-        if( !circular ) // usual mean
-        {
-            particles_i = cvGetRow( p->particles, &hdr, i );
-            double mean = 0;
-            for( j = 0; j < p->num_particles; j++ )
-            {
-                mean += cvmGet( particles_i, 0, j ) * cvmGet( weights, 0, j );
-            }
-            cvmSet( meanp, i, 0, mean );
-        }
-        else // wrapped mean (angle)
-        {
-            double wrap = cvmGet( p->bound, i, 1 ) - cvmGet( p->bound, i, 0 );
-            particles_i = cvGetRow( p->particles, &hdr, i );
-            CvScalar mean = cvAngleMean( particles_i, weights, wrap );
-            cvmSet( meanp, i, 0, mean.val[0] );
-        }
-    }
-
-    if( weights != p->weights )
-        cvReleaseMat( &weights );
+        cvmSet( meanp, i, 0, mean[i] );
     __END__;
 }
 
@@ -325,90 +1008,1095 @@ CVAPI(void) cvParticlePrint( const CvParticle*p, int p_id CV_DEFAULT(-1) )
     }
 }
 
-/****************************** Helper functions ******************************/
-/*
- * Do normalization of weights
+/**
+ * Get the average wall time of a stage
  *
  * @param particle
- * @see cvParticleResample
+ * @param stage     CV_PARTICLE_PROFILE_*
+ * @return msec per call. 0 if not called or instrumentation is disabled
+ * @see cvParticleSetProfile
  */
-CVAPI(void) cvParticleNormalize( CvParticle* p )
+CVAPI(double) cvParticleProfileMsec( const CvParticle* p, int stage )
 {
-    if( !p->logweight )
-    {
-        CvScalar normterm = cvSum( p->weights );
-        cvScale( p->weights, p->weights, 1.0 / normterm.val[0] );
-    }
-    else // log version
-    {
-        CvScalar normterm = cvLogSum( p->weights );
-        cvSubS( p->weights, normterm, p->weights );
-    }
+    const CvParticleProfile* prof = p->profile;
+    if( prof == NULL || prof->calls[stage] == 0 ) return 0;
+    return prof->ticks[stage] / ( cvGetTickFrequency() * 1000 ) / prof->calls[stage];
 }
 
 /**
- * Apply lower bound and upper bound for particle states.
+ * Print counters of cvParticleSetProfile
  *
  * @param particle
- * @note Used by See also functions
- * @see cvParticleTransition
  */
-CVAPI(void) cvParticleBound( CvParticle* p )
+CVAPI(void) cvParticlePrintProfile( const CvParticle* p )
 {
-    int row, col;
-    double lower, upper;
-    int circular;
-    CvMat* stateparticles, hdr;
-    float state;
-    // @todo:     np.width   = (double)MAX( 2.0, MIN( maxX - 1 - x, width ) );
-    for( row = 0; row < p->num_states; row++ )
-    {
-        lower = cvmGet( p->bound, row, 0 );
-        upper = cvmGet( p->bound, row, 1 );
-        circular = (int) cvmGet( p->bound, row, 2 );
-        if( lower == upper ) continue; // no bound flag
-        if( circular ) {
-            for( col = 0; col < p->num_particles; col++ ) {
-                state = cvmGet( p->particles, row, col );
-                state = state < lower ? state + upper : ( state >= upper ? state - upper : state );
-                cvmSet( p->particles, row, col, state );
-            }
-        } else {
-            stateparticles = cvGetRow( p->particles, &hdr, row );
-            cvMinS( stateparticles, upper, stateparticles );
-            cvMaxS( stateparticles, lower, stateparticles );
-        }
+    static const char* names[CV_PARTICLE_PROFILE_NUM] = {
+        "transition", "bound", "observe", "normalize", "resample"
+    };
+    int i;
+    if( p->profile == NULL ) return;
+    for( i = 0; i < CV_PARTICLE_PROFILE_NUM; i++ )
+    {
+        printf( "%-10s %8d calls %10.3f ms/call\n", names[i], 
+                p->profile->calls[i], cvParticleProfileMsec( p, i ) );
     }
+    printf( "ess %.1f, unique %d / %d\n", p->profile->ess, 
+            p->profile->unique, p->num_particles );
+    fflush( stdout );
 }
 
-/******************* Main (Related to Algorithm) *****************************/
+/***************************** Snapshot *************************************/
 
 /**
- * Initialize states
+ * Header of a snapshot file
+ */
+typedef struct CvParticleSnapshotHeader {
+    char magic[4];      /**< CV_PARTICLE_SNAPSHOT_MAGIC */
+    int version;        /**< CV_PARTICLE_SNAPSHOT_VERSION */
+    int header_size;    /**< sizeof( CvParticleSnapshotHeader ) */
+    int num_states;
+    int num_particles;
+    int max_particles;
+    int logweight;
+    int resample;
+    int has_prior;
+    int counter_rng;
+    unsigned int rng_frame;
+    int min_particles;
+    int has_kld;        /**< kld_binsize follows */
+    int has_cache;      /**< cache_tol follows */
+    int stds_cols;      /**< stds (num_states x stds_cols) follows if > 0 */
+    int reserved;
+    uint64 rng;
+    uint64 rng_seed;
+    double kld_epsilon;
+    double kld_z;
+} CvParticleSnapshotHeader;
+
+/**
+ * Copy a matrix into or out of a snapshot buffer
  *
- * If initial states are given, these states are uniformly copied.
- * If not given, states are uniform randomly sampled within lowerbound 
- * and upperbound regions.
+ * @param buf   position in the buffer. Advanced
+ * @param mat   matrix
+ * @param type  element type in the buffer
+ * @param out   copy mat into the buffer if true, otherwise the buffer into mat
+ */
+CV_INLINE void icvParticleSnapshotMat( uchar** buf, CvMat* mat, int type, bool out )
+{
+    CvMat hdr = cvMat( mat->rows, mat->cols, type, *buf );
+    if( out )
+        cvConvert( mat, &hdr );
+    else
+        cvConvert( &hdr, mat );
+    *buf += mat->rows * mat->cols * CV_ELEM_SIZE( type );
+}
+
+/**
+ * Save the full state of a particle filter into a binary file
+ *
+ * Configuration (dynamics, noise, bound, resampling, KLD-sampling, 
+ * cache), the active particles, weights, and the random state are 
+ * packed into one buffer and written at once. cvLoadParticle restores 
+ * the filter so that tracking continues exactly as it would have. 
+ * The file is in the native byte order. 
  *
+ * @param filename
  * @param particle
- * @param init       initial states.
+ * @see cvLoadParticle
  */
-CVAPI(void) cvParticleInit( CvParticle* p, const CvParticle* init = NULL )
+CVAPI(void) cvSaveParticle( const char* filename, const CvParticle* p )
 {
-    int i, c, n, s;
-    if( init ) // copy
-    {
-        int *num_copy;
-        CvMat init_particle;
+    CvParticleSnapshotHeader header;
+    int S = p->num_states, n = p->num_particles;
+    size_t size;
+    uchar* buf = NULL, *ptr;
+    FILE* fp = NULL;
+    CvMat sub;
+    CV_FUNCNAME( "cvSaveParticle" );
+    __BEGIN__;
 
-        int divide = p->num_particles / init->num_particles;
-        int remain = p->num_particles - divide * init->num_particles;
-        num_copy = (int*) malloc( init->num_particles * sizeof(int) );
-        for( i = 0; i < init->num_particles; i++ )
-        {
-            num_copy[i] = divide + ( i < remain ? 1 : 0 );
-        }
-        
+    memset( &header, 0, sizeof( header ) );
+    memcpy( header.magic, CV_PARTICLE_SNAPSHOT_MAGIC, 4 );
+    header.version       = CV_PARTICLE_SNAPSHOT_VERSION;
+    header.header_size   = sizeof( header );
+    header.num_states    = S;
+    header.num_particles = n;
+    header.max_particles = p->max_particles;
+    header.logweight     = p->logweight;
+    header.resample      = p->resample;
+    header.has_prior     = p->has_prior;
+    header.counter_rng   = p->counter_rng;
+    header.rng_frame     = p->rng_frame;
+    header.min_particles = p->min_particles;
+    header.has_kld       = p->kld_epsilon > 0 && p->kld_binsize != NULL;
+    header.has_cache     = p->cache_tol != NULL;
+    header.stds_cols     = p->stds != NULL ? p->stds->cols : 0;
+    header.rng           = p->rng;
+    header.rng_seed      = p->rng_seed;
+    header.kld_epsilon   = p->kld_epsilon;
+    header.kld_z         = p->kld_z;
+
+    size = sizeof( header ) + 
+        sizeof( float ) * ( S * S + S + 3 * S + 3 * S + S * n + S * header.stds_cols ) + 
+        sizeof( double ) * ( 2 * n + ( header.has_kld ? S : 0 ) + ( header.has_cache ? S : 0 ) );
+    CV_CALL( buf = (uchar*)cvAlloc( size ) );
+    memcpy( buf, &header, sizeof( header ) );
+    ptr = buf + sizeof( header );
+    icvParticleSnapshotMat( &ptr, p->dynamics, CV_32FC1, true );
+    icvParticleSnapshotMat( &ptr, p->std, CV_32FC1, true );
+    icvParticleSnapshotMat( &ptr, p->bound, CV_32FC1, true );
+    icvParticleSnapshotMat( &ptr, p->bound_linear, CV_32FC1, true );
+    icvParticleSnapshotMat( &ptr, cvGetCols( p->particles, &sub, 0, n ), CV_32FC1, true );
+    icvParticleSnapshotMat( &ptr, cvGetCols( p->weights, &sub, 0, n ), CV_64FC1, true );
+    icvParticleSnapshotMat( &ptr, cvGetCols( p->prior_weights, &sub, 0, n ), CV_64FC1, true );
+    if( header.stds_cols > 0 )
+        icvParticleSnapshotMat( &ptr, p->stds, CV_32FC1, true );
+    if( header.has_kld )
+        icvParticleSnapshotMat( &ptr, p->kld_binsize, CV_64FC1, true );
+    if( header.has_cache )
+        icvParticleSnapshotMat( &ptr, p->cache_tol, CV_64FC1, true );
+    if( (size_t)( ptr - buf ) != size )
+        CV_ERROR( CV_StsInternal, "Snapshot size mismatch." );
+
+    if( ( fp = fopen( filename, "wb" ) ) == NULL )
+        CV_ERROR( CV_StsError, "Cannot open the file to write." );
+    if( fwrite( buf, 1, size, fp ) != size )
+        CV_ERROR( CV_StsError, "Cannot write the file." );
+    __END__;
+    if( fp != NULL ) fclose( fp );
+    if( buf != NULL ) cvFree( &buf );
+}
+
+/**
+ * Load a particle filter saved by cvSaveParticle
+ *
+ * The file is read at once and matrices are copied out of the buffer 
+ * without parsing elements. 
+ *
+ * @param filename
+ * @return CvParticle*. NULL if the file cannot be opened or read, or is 
+ *         not a valid snapshot of this version (e.g., truncated)
+ * @see cvSaveParticle
+ */
+CVAPI(CvParticle*) cvLoadParticle( const char* filename )
+{
+    CvParticleSnapshotHeader header;
+    CvParticle* p = NULL;
+    FILE* fp = NULL;
+    long size = 0;
+    uchar* buf = NULL, *ptr;
+    int S, n;
+    bool ok = false;
+    CV_FUNCNAME( "cvLoadParticle" );
+    __BEGIN__;
+
+    if( ( fp = fopen( filename, "rb" ) ) == NULL ) EXIT;
+    fseek( fp, 0, SEEK_END );
+    size = ftell( fp );
+    fseek( fp, 0, SEEK_SET );
+    if( size < (long)sizeof( header ) ) EXIT;
+    CV_CALL( buf = (uchar*)cvAlloc( size ) );
+    if( fread( buf, 1, size, fp ) != (size_t)size ) EXIT;
+    memcpy( &header, buf, sizeof( header ) );
+    if( memcmp( header.magic, CV_PARTICLE_SNAPSHOT_MAGIC, 4 ) != 0 || 
+        header.version != CV_PARTICLE_SNAPSHOT_VERSION || 
+        header.header_size != (int)sizeof( header ) )
+        EXIT;
+    S = header.num_states;
+    n = header.num_particles;
+    if( S <= 0 || n <= 0 || n > header.max_particles || 
+        header.stds_cols < 0 || ( header.stds_cols > 0 && header.stds_cols < n ) ||
+        header.min_particles <= 0 || header.min_particles > header.max_particles ||
+        header.resample < CV_PARTICLE_RESAMPLE_ROUND || 
+        header.resample > CV_PARTICLE_RESAMPLE_MULTINOMIAL ||
+        ( header.has_kld && !( header.kld_epsilon > 0 && header.kld_z > 0 ) ) )
+        EXIT;
+    // in double not to overflow by broken sizes
+    if( (double)size != (double)sizeof( header ) + 
+        sizeof( float ) * ( (double)S * S + 7.0 * S + (double)S * n + 
+                            (double)S * header.stds_cols ) + 
+        sizeof( double ) * ( 2.0 * n + ( header.has_kld ? S : 0 ) + 
+                             ( header.has_cache ? S : 0 ) ) )
+        EXIT;
+
+    CV_CALL( p = cvCreateParticle( S, header.max_particles, header.logweight != 0 ) );
+    ptr = buf + sizeof( header );
+    {
+        CvMat dynamics = cvMat( S, S, CV_32FC1, ptr );
+        ptr += S * S * sizeof( float );
+        CV_CALL( cvParticleSetDynamics( p, &dynamics ) ); // classify its structure again
+    }
+    icvParticleSnapshotMat( &ptr, p->std, CV_32FC1, false );
+    icvParticleSnapshotMat( &ptr, p->bound, CV_32FC1, false );
+    icvParticleSnapshotMat( &ptr, p->bound_linear, CV_32FC1, false );
+    icvParticleSetActive( p, n );
+    icvParticleSnapshotMat( &ptr, p->particles, CV_32FC1, false );
+    icvParticleSnapshotMat( &ptr, p->weights, CV_64FC1, false );
+    icvParticleSnapshotMat( &ptr, p->prior_weights, CV_64FC1, false );
+    if( header.stds_cols > 0 )
+    {
+        p->stds = cvCreateMat( S, header.stds_cols, CV_32FC1 );
+        icvParticleSnapshotMat( &ptr, p->stds, CV_32FC1, false );
+    }
+    if( header.has_kld )
+    {
+        CvMat binsize = cvMat( S, 1, CV_64FC1, ptr );
+        ptr += S * sizeof( double );
+        icvParticleSetKld( p, header.min_particles, header.kld_epsilon, 
+                           header.kld_z, &binsize );
+    }
+    p->min_particles = header.min_particles;
+    if( header.has_cache )
+    {
+        CvMat tol = cvMat( S, 1, CV_64FC1, ptr );
+        ptr += S * sizeof( double );
+        CV_CALL( cvParticleSetCache( p, &tol ) );
+    }
+    p->resample    = header.resample;
+    p->has_prior   = header.has_prior != 0;
+    p->rng         = header.rng;
+    p->counter_rng = header.counter_rng != 0;
+    p->rng_seed    = header.rng_seed;
+    p->rng_frame   = header.rng_frame;
+    ok = true;
+    __END__;
+    if( !ok && p != NULL ) cvReleaseParticle( &p );
+    if( fp != NULL ) fclose( fp );
+    if( buf != NULL ) cvFree( &buf );
+    return p;
+}
+
+/****************************** Helper functions ******************************/
+/*
+ * Do normalization of weights
+ *
+ * If cvParticleResampleIfNeeded skipped resampling at the previous frame, 
+ * the weights of the previous frame are multiplied first (importance 
+ * weights are accumulated until the next resampling).
+ * Linear weights summing to 0 become uniform.
+ *
+ * @param particle
+ * @see cvParticleResample
+ */
+CVAPI(void) cvParticleNormalize( CvParticle* p )
+{
+    int64 start = icvParticleProfileBegin( p );
+    if( p->has_prior )
+    {
+        if( !p->logweight )
+            cvMul( p->weights, p->prior_weights, p->weights );
+        else
+            cvAdd( p->weights, p->prior_weights, p->weights );
+        p->has_prior = false;
+    }
+    if( !p->logweight )
+    {
+        CvScalar normterm = cvSum( p->weights );
+        if( normterm.val[0] > 0 )
+            cvScale( p->weights, p->weights, 1.0 / normterm.val[0] );
+        else // no particle has likelihood. uniform rather than NaN
+            cvSet( p->weights, cvScalar( 1.0 / p->num_particles ) );
+    }
+    else // log version
+    {
+        cvLogNormalize( p->weights->data.db, p->num_particles );
+    }
+    icvParticleProfileEnd( p, CV_PARTICLE_PROFILE_NORMALIZE, start );
+}
+
+/**
+ * Compute the effective sample size (ESS) of weights
+ *
+ * ESS = (sum w)^2 / sum w^2, which is 1 / sum w^2 for normalized weights.
+ * It becomes num_particles for uniform weights and 1 when only one 
+ * particle has weight. Works for both linear and log weights. 
+ *
+ * @param particle
+ * @return ESS
+ * @see cvParticleResampleIfNeeded
+ */
+CVAPI(double) cvParticleEffectiveSampleSize( const CvParticle* p )
+{
+    int i;
+    const double* w = p->weights->data.db;
+    double maxval = 0, sum = 0, sqsum = 0, weight;
+    if( p->logweight )
+    {
+        maxval = -DBL_MAX;
+        for( i = 0; i < p->num_particles; i++ )
+            maxval = MAX( maxval, w[i] );
+    }
+    for( i = 0; i < p->num_particles; i++ )
+    {
+        weight = p->logweight ? exp( w[i] - maxval ) : w[i];
+        sum += weight;
+        sqsum += weight * weight;
+    }
+    return sqsum > 0 ? sum * sum / sqsum : 0;
+}
+
+/**
+ * Quantized key of a state for the likelihood cache
+ */
+CV_INLINE unsigned int icvParticleCacheKey( float state, double tol )
+{
+    unsigned int key;
+    if( tol > 0 )
+        return (unsigned int)cvFloor( state / tol );
+    memcpy( &key, &state, sizeof( key ) ); // exact match
+    return key;
+}
+
+/**
+ * Find duplicated particles before measurement
+ *
+ * Sets p->duplicates->data.i[i] to the id of the first particle whose 
+ * quantized states are the same with the i-th particle. Observation models 
+ * should measure only particles such that duplicates[i] == i and then call
+ * cvParticleCopyDuplicates. Without cvParticleSetCache, 
+ * every particle is its own.
+ *
+ * @code
+ * cvParticleFindDuplicates( p );
+ * for( i = 0; i < p->num_particles; i++ ) {
+ *     if( p->duplicates->data.i[i] != i ) continue;
+ *     // measure and set weights( 0, i )
+ * }
+ * cvParticleCopyDuplicates( p );
+ * @endcode
+ *
+ * @param particle
+ * @return Number of particles to be measured
+ * @see cvParticleSetCache
+ */
+CVAPI(int) cvParticleFindDuplicates( CvParticle* p )
+{
+    int i, k, s, other, unique = 0;
+    int* duplicates = p->duplicates->data.i;
+    const CvMat* particles = p->particles;
+    const double* tol;
+    int* table;
+    int mask;
+    unsigned int hash;
+    if( p->cache_tol == NULL )
+    {
+        for( i = 0; i < p->num_particles; i++ )
+            duplicates[i] = i;
+        return p->num_particles;
+    }
+    tol = p->cache_tol->data.db;
+    table = p->cache_table->data.i;
+    mask = p->cache_table->cols - 1;
+    memset( table, 0, sizeof( int ) * ( mask + 1 ) );
+
+    for( i = 0; i < p->num_particles; i++ )
+    {
+        hash = 2166136261u;
+        for( s = 0; s < p->num_states; s++ )
+        {
+            if( tol[s] < 0 ) continue;
+            hash = ( hash ^ icvParticleCacheKey( CV_MAT_ELEM( *particles, float, s, i ), tol[s] ) ) * 16777619u;
+        }
+        for( k = hash & mask; table[k] != 0; k = ( k + 1 ) & mask )
+        {
+            other = table[k] - 1;
+            for( s = 0; s < p->num_states; s++ )
+            {
+                if( tol[s] < 0 ) continue;
+                if( icvParticleCacheKey( CV_MAT_ELEM( *particles, float, s, i ), tol[s] ) != 
+                    icvParticleCacheKey( CV_MAT_ELEM( *particles, float, s, other ), tol[s] ) ) break;
+            }
+            if( s == p->num_states ) break; // same
+        }
+        if( table[k] != 0 )
+        {
+            duplicates[i] = table[k] - 1;
+        }
+        else
+        {
+            table[k] = i + 1;
+            duplicates[i] = i;
+            unique++;
+        }
+    }
+    p->cache_misses += unique;
+    p->cache_hits   += p->num_particles - unique;
+    return unique;
+}
+
+/**
+ * Copy likelihoods of measured particles to their duplicates
+ *
+ * @param particle
+ * @see cvParticleFindDuplicates
+ */
+CVAPI(void) cvParticleCopyDuplicates( CvParticle* p )
+{
+    int i;
+    const int* duplicates = p->duplicates->data.i;
+    double* weights = p->weights->data.db;
+    if( p->cache_tol == NULL ) return;
+    for( i = 0; i < p->num_particles; i++ )
+    {
+        weights[i] = weights[duplicates[i]];
+    }
+}
+
+/**
+ * Select candidates passed to the next stage of a cascaded observation
+ *
+ * An observation model scores particles by a cheap measure first, and 
+ * measures only the selected ones by the expensive likelihood. 
+ * Candidates whose scores are below threshold are rejected, and at most 
+ * ceil(keep_ratio * n) of the rest with the largest scores are selected. 
+ *
+ * @param scores     n. scores of candidates (larger is better)
+ * @param n          number of candidates
+ * @param keep_ratio maximum fraction of candidates to be selected (0, 1]
+ * @param threshold  minimum score to be selected. -DBL_MAX for none
+ * @param order      n. output. order[0 .. return value) are indices of 
+ *                   the selected candidates, and the rest are rejected ones
+ * @return number of selected candidates
+ */
+CVAPI(int) cvParticleCascadeSelect( const double* scores, int n, double keep_ratio, 
+                                    double threshold, int* order )
+{
+    int i, m, k;
+    for( i = 0, m = 0, k = n; i < n; i++ ) // above threshold first
+    {
+        if( scores[i] >= threshold )
+            order[m++] = i;
+        else
+            order[--k] = i;
+    }
+    k = MIN( m, (int)ceil( keep_ratio * n ) );
+    if( k < m )
+        std::nth_element( order, order + k, order + m, icvParticleWeightGreater( scores ) );
+    return k;
+}
+
+/**
+ * Bounding kernel of cvParticleBound and cvParticleBoundT
+ *
+ * @param particle
+ * @tparam S        number of states, or 0 to use p->num_states
+ */
+template<int S>
+inline void icvParticleBound( CvParticle* p )
+{
+    int row, col, start, end;
+    int num_states = ( S > 0 ) ? S : p->num_states;
+    int step = p->particles->step;
+    uchar* data = p->particles->data.ptr;
+    float* lower  = (float*)cvStackAlloc( num_states * sizeof( float ) );
+    float* upper  = (float*)cvStackAlloc( num_states * sizeof( float ) );
+    int* circular = (int*)cvStackAlloc( num_states * sizeof( int ) );
+    int* ref      = (int*)cvStackAlloc( num_states * sizeof( int ) );
+    float* coeff  = (float*)cvStackAlloc( num_states * sizeof( float ) );
+    float* offset = (float*)cvStackAlloc( num_states * sizeof( float ) );
+    for( row = 0; row < num_states; row++ )
+    {
+        lower[row]    = (float)cvmGet( p->bound, row, 0 );
+        upper[row]    = (float)cvmGet( p->bound, row, 1 );
+        circular[row] = (int) cvmGet( p->bound, row, 2 );
+        ref[row]      = cvRound( cvmGet( p->bound_linear, row, 0 ) );
+        coeff[row]    = (float)cvmGet( p->bound_linear, row, 1 );
+        offset[row]   = (float)cvmGet( p->bound_linear, row, 2 );
+    }
+    for( start = 0; start < p->num_particles; start += CV_PARTICLE_BOUND_BLOCK )
+    {
+        end = MIN( start + CV_PARTICLE_BOUND_BLOCK, p->num_particles );
+        for( row = 0; row < num_states; row++ )
+        {
+            float* state = (float*)( data + step * row );
+            float lo = lower[row], up = upper[row];
+            if( lo == up ) continue; // no bound flag
+            if( circular[row] ) {
+                float range = up - lo;
+                for( col = start; col < end; col++ ) {
+                    float v = state[col];
+                    v = v < lo ? v + range : v;
+                    v = v >= up ? v - range : v;
+                    state[col] = v;
+                }
+            } else {
+                for( col = start; col < end; col++ ) {
+                    float v = state[col];
+                    v = v > up ? up : v;
+                    v = v < lo ? lo : v;
+                    state[col] = v;
+                }
+            }
+        }
+        for( row = 0; row < num_states; row++ )
+        {
+            if( ref[row] < 0 ) continue;
+            float* state = (float*)( data + step * row );
+            const float* refstate = (const float*)( data + step * ref[row] );
+            float a = coeff[row], b = offset[row];
+            for( col = start; col < end; col++ ) {
+                float v = b + a * refstate[col];
+                state[col] = state[col] > v ? v : state[col];
+            }
+        }
+    }
+}
+
+/**
+ * Apply lower bound and upper bound for particle states.
+ *
+ * The bounds of cvParticleSetBound (clamp or wrap around) and then the 
+ * linear bounds of cvParticleSetBoundLinear are applied to blocks of 
+ * CV_PARTICLE_BOUND_BLOCK particles, so that the particles are swept 
+ * once while a block stays in cache. 
+ *
+ * @param particle
+ * @note Used by See also functions
+ * @see cvParticleTransition
+ * @see cvParticleBoundT for a compile-time number of states
+ */
+CVAPI(void) cvParticleBound( CvParticle* p )
+{
+    int64 ticks = icvParticleProfileBegin( p );
+    icvParticleBound<0>( p );
+    icvParticleProfileEnd( p, CV_PARTICLE_PROFILE_BOUND, ticks );
+}
+
+/**
+ * Apply lower bound and upper bound with a compile-time number of states
+ *
+ * Same as cvParticleBound, but the loops over the states have 
+ * the constant trip count S. 
+ *
+ * @param particle  p->num_states must be S
+ * @see cvParticleBound
+ */
+template<int S>
+inline void cvParticleBoundT( CvParticle* p )
+{
+    int64 ticks = icvParticleProfileBegin( p );
+    CV_FUNCNAME( "cvParticleBoundT" );
+    __BEGIN__;
+    CV_ASSERT( p->num_states == S );
+    icvParticleBound<S>( p );
+    icvParticleProfileEnd( p, CV_PARTICLE_PROFILE_BOUND, ticks );
+    __END__;
+}
+
+/**
+ * Draw ids by systematic or stratified resampling from cumulative weights
+ *
+ * @param rng        random state
+ * @param cumweights n_in cumulative weights (need not to be normalized)
+ * @param n_in       number of weights
+ * @param ids        n_out output ids
+ * @param n_out      number of particles to draw
+ * @param stratified draw a random pointer for each stratum or not
+ */
+CV_INLINE void icvParticleSystematicIds( CvRNG* rng, const double* cumweights, int n_in,
+                                         int* ids, int n_out, bool stratified )
+{
+    int i, k;
+    double sum = cumweights[n_in - 1];
+    double u = cvRandReal( rng ), pointer;
+    for( i = 0, k = 0; k < n_out; k++ )
+    {
+        if( stratified && k > 0 )
+            u = cvRandReal( rng );
+        pointer = ( k + u ) * sum / n_out;
+        while( i < n_in - 1 && cumweights[i] <= pointer ) i++;
+        ids[k] = i;
+    }
+}
+
+/**
+ * Draw ids of particles survived by resampling
+ *
+ * Every method runs in O(n_in + n_out): the cumulative weights are 
+ * computed once and merged with sorted pointers in one pass. 
+ * Weights need not to be normalized.
+ *
+ * @param rng        random state
+ * @param method     CV_PARTICLE_RESAMPLE_*
+ * @param weights    n_in weights (or log weights)
+ * @param logweight  weights are log or not
+ * @param n_in       number of weights
+ * @param cumweights n_in scratch to store cumulative weights
+ * @param ids        n_out output ids of survived particles
+ * @param n_out      number of particles to draw
+ * @see cvParticleResample
+ */
+CV_INLINE void icvParticleResampleIds( CvRNG* rng, int method, const double* weights, 
+                                       bool logweight, int n_in, double* cumweights, 
+                                       int* ids, int n_out )
+{
+    int i, k, c;
+    double sum, u, weight;
+
+    // cumulative weights
+    sum = 0;
+    for( i = 0; i < n_in; i++ )
+    {
+        sum += logweight ? exp( weights[i] ) : weights[i];
+        cumweights[i] = sum;
+    }
+    if( !( sum > 0 ) || sum > DBL_MAX ) // degenerated, regard as uniform
+    {
+        for( i = 0; i < n_in; i++ )
+            cumweights[i] = i + 1;
+        sum = n_in;
+    }
+
+    switch( method )
+    {
+    case CV_PARTICLE_RESAMPLE_SYSTEMATIC:
+        icvParticleSystematicIds( rng, cumweights, n_in, ids, n_out, false );
+        break;
+    case CV_PARTICLE_RESAMPLE_STRATIFIED:
+        icvParticleSystematicIds( rng, cumweights, n_in, ids, n_out, true );
+        break;
+    case CV_PARTICLE_RESAMPLE_MULTINOMIAL:
+        // sorted uniforms are generated in descending order as
+        // u_(k) = u_(k+1) * U^(1/(k+1)) to avoid sorting
+        u = sum;
+        for( i = n_in - 1, k = n_out - 1; k >= 0; k-- )
+        {
+            u *= pow( 1.0 - cvRandReal( rng ), 1.0 / ( k + 1 ) );
+            while( i > 0 && cumweights[i - 1] > u ) i--;
+            ids[k] = i;
+        }
+        break;
+    case CV_PARTICLE_RESAMPLE_RESIDUAL:
+        // deterministic floor( n_out * weight ) copies, 
+        // cumweights are overwritten by cumulative residuals
+        k = 0;
+        u = 0;
+        for( i = 0; i < n_in; i++ )
+        {
+            weight = ( cumweights[i] - u ) * n_out / sum;
+            u = cumweights[i];
+            for( c = cvFloor( weight ); c > 0 && k < n_out; c-- )
+                ids[k++] = i;
+            cumweights[i] = ( weight - cvFloor( weight ) ) + 
+                ( i > 0 ? cumweights[i - 1] : 0 );
+        }
+        if( k < n_out )
+        {
+            if( !( cumweights[n_in - 1] > 0 ) )
+            {
+                for( i = 0; i < n_in; i++ )
+                    cumweights[i] = i + 1;
+            }
+            icvParticleSystematicIds( rng, cumweights, n_in, ids + k, n_out - k, false );
+        }
+        break;
+    case CV_PARTICLE_RESAMPLE_ROUND:
+    default:
+        {
+            int max_id = 0;
+            double maxweight = -1;
+            k = 0;
+            u = 0;
+            for( i = 0; i < n_in; i++ )
+            {
+                weight = cumweights[i] - u;
+                u = cumweights[i];
+                if( weight > maxweight )
+                {
+                    maxweight = weight;
+                    max_id = i;
+                }
+                for( c = cvRound( weight / sum * n_out ); c > 0 && k < n_out; c-- )
+                    ids[k++] = i;
+            }
+            while( k < n_out )
+                ids[k++] = max_id;
+        }
+        break;
+    }
+}
+
+/**
+ * Gather particles (columns) by ids
+ *
+ * dst(:, k) = src(:, ids[k]) for k = 0, ..., n-1. Row by row so that 
+ * each state is written contiguously.
+ *
+ * @param src  num_states x num_particles. CV_32FC1
+ * @param dst  num_states x (>= n). CV_32FC1. Must not be src.
+ * @param ids  n ids of src particles
+ * @param n    number of particles to gather
+ */
+CV_INLINE void icvParticleGather( const CvMat* src, CvMat* dst, const int* ids, int n )
+{
+    int row, k;
+    const float* srcrow;
+    float* dstrow;
+    for( row = 0; row < src->rows; row++ )
+    {
+        srcrow = (const float*)( src->data.ptr + (size_t)src->step * row );
+        dstrow = (float*)( dst->data.ptr + (size_t)dst->step * row );
+        for( k = 0; k < n; k++ )
+        {
+            dstrow[k] = srcrow[ids[k]];
+        }
+    }
+}
+
+/**
+ * Count distinct ids
+ *
+ * @param ids       n ids in [0, n_in)
+ * @param n
+ * @param marks     n_in scratch
+ * @param n_in
+ * @return number of distinct ids
+ */
+CV_INLINE int icvParticleCountUnique( const int* ids, int n, int* marks, int n_in )
+{
+    int i, unique = 0;
+    memset( marks, 0, sizeof( int ) * n_in );
+    for( i = 0; i < n; i++ )
+    {
+        unique += !marks[ids[i]];
+        marks[ids[i]] = 1;
+    }
+    return unique;
+}
+
+/**
+ * Resample with KLD-sampling
+ *
+ * Draws particles one by one (multinomial, binary search on the cumulative 
+ * weights) into the back buffer until the number of particles exceeds the 
+ * KLD bound given by the number of occupied bins, and then swaps.
+ *
+ * @param particle
+ * @see cvParticleSetKld
+ */
+CV_INLINE void icvParticleResampleKld( CvParticle* p )
+{
+    int n_in = p->num_particles;
+    int n, k, id, lo, hi, s, bins = 0, target = p->min_particles;
+    int num_states = p->num_states;
+    int mask = p->kld_table->cols - 1;
+    int* table = p->kld_table->data.i;
+    const double* binsize = p->kld_binsize->data.db;
+    const double* weights = p->weights->data.db;
+    double* cumweights = p->cumweights->data.db;
+    const CvMat* src = p->particles;
+    CvMat* dst = p->particles_buf;
+    double sum = 0, u, kld;
+    unsigned int hash;
+    CvMat* tmp;
+
+    for( k = 0; k < n_in; k++ )
+    {
+        sum += p->logweight ? exp( weights[k] ) : weights[k];
+        cumweights[k] = sum;
+    }
+    if( !( sum > 0 ) || sum > DBL_MAX ) // degenerated, regard as uniform
+    {
+        for( k = 0; k < n_in; k++ )
+            cumweights[k] = k + 1;
+        sum = n_in;
+    }
+    memset( table, 0, sizeof( int ) * ( mask + 1 ) );
+
+    for( n = 0; n < p->max_particles && ( n < target || n < p->min_particles ); n++ )
+    {
+        // draw
+        u = cvRandReal( &p->rng ) * sum;
+        for( lo = 0, hi = n_in - 1; lo < hi; )
+        {
+            id = ( lo + hi ) / 2;
+            if( cumweights[id] <= u ) lo = id + 1;
+            else hi = id;
+        }
+        id = lo;
+        for( s = 0; s < num_states; s++ )
+        {
+            CV_MAT_ELEM( *dst, float, s, n ) = CV_MAT_ELEM( *src, float, s, id );
+        }
+        p->ids->data.i[n] = id;
+
+        // look up the bin of the drawn particle
+        hash = 2166136261u;
+        for( s = 0; s < num_states; s++ )
+        {
+            if( binsize[s] <= 0 ) continue;
+            hash = ( hash ^ (unsigned int)cvFloor( CV_MAT_ELEM( *dst, float, s, n ) / binsize[s] ) ) * 16777619u;
+        }
+        for( k = hash & mask; table[k] != 0; k = ( k + 1 ) & mask )
+        {
+            int other = table[k] - 1;
+            for( s = 0; s < num_states; s++ )
+            {
+                if( binsize[s] <= 0 ) continue;
+                if( cvFloor( CV_MAT_ELEM( *dst, float, s, n ) / binsize[s] ) != 
+                    cvFloor( CV_MAT_ELEM( *dst, float, s, other ) / binsize[s] ) ) break;
+            }
+            if( s == num_states ) break; // same bin
+        }
+        if( table[k] != 0 ) continue;
+        table[k] = n + 1;
+
+        // update the required number of particles
+        if( ++bins > 1 )
+        {
+            kld = 2.0 / ( 9.0 * ( bins - 1 ) );
+            kld = 1.0 - kld + sqrt( kld ) * p->kld_z;
+            target = cvCeil( ( bins - 1 ) / ( 2.0 * p->kld_epsilon ) * kld * kld * kld );
+        }
+    }
+
+    CV_SWAP( p->particles, p->particles_buf, tmp );
+    icvParticleSetActive( p, n );
+}
+
+/**
+ * Set uniform random values to a state of particles
+ *
+ * @param particle
+ * @param s         state id
+ * @param start     first particle id
+ * @param n         number of particles
+ * @param lower     lower bound
+ * @param upper     upper bound
+ */
+CV_INLINE void icvParticleRandUniform( CvParticle* p, int s, int start, int n, 
+                                       double lower, double upper )
+{
+    int j;
+    if( n <= 0 ) return;
+    if( p->counter_rng )
+    {
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+        for( j = 0; j < n; j++ )
+        {
+            unsigned int ctr[4] = { (unsigned int)( start + j ), (unsigned int)s, p->rng_frame, 1 };
+            cvmSet( p->particles, s, start + j, 
+                    lower + ( upper - lower ) * cvRandPhiloxReal( p->rng_seed, ctr ) );
+        }
+    }
+    else
+    {
+        CvMat sub;
+        cvGetSubRect( p->particles, &sub, cvRect( start, s, n, 1 ) );
+        cvRandArr( &p->rng, &sub, CV_RAND_UNI, cvScalar( lower ), cvScalar( upper ) );
+    }
+}
+
+/**
+ * Generate transition noises by counter-based random numbers
+ *
+ * The noise of (particle, state) at rng_frame is independent of the 
+ * others, so particles are processed in parallel. 
+ *
+ * @param particle
+ * @see cvParticleSetCounterRng
+ */
+CV_INLINE void icvParticleCounterNoise( CvParticle* p )
+{
+    int i, j;
+#ifdef _OPENMP
+#pragma omp parallel for private(i)
+#endif
+    for( j = 0; j < p->num_particles; j++ )
+    {
+        unsigned int ctr[4] = { (unsigned int)j, 0, p->rng_frame, 0 };
+        for( i = 0; i < p->num_states; i++ )
+        {
+            double std = ( p->stds == NULL ) ? cvmGet( p->std, i, 0 ) : cvmGet( p->stds, i, j );
+            ctr[1] = (unsigned int)i;
+            CV_MAT_ELEM( *p->noises, float, i, j ) = 
+                ( std == 0.0 ) ? 0.0f : (float)cvRandPhiloxGauss( p->rng_seed, ctr, std );
+        }
+    }
+    p->rng_frame++;
+}
+
+/**
+ * Constant velocity dynamics in place
+ *
+ * curr := 2 * curr - prev + noise, prev := curr + noise 
+ * for the first and the last halves of states
+ *
+ * @param particle
+ * @tparam S        number of states, or 0 to use p->num_states
+ */
+template<int S>
+inline void icvParticleTransitionConstVel( CvParticle* p )
+{
+    int half = ( ( S > 0 ) ? S : p->num_states ) / 2;
+    int i, j;
+    for( i = 0; i < half; i++ )
+    {
+        float* curr = (float*)( p->particles->data.ptr + p->particles->step * i );
+        float* prev = (float*)( p->particles->data.ptr + p->particles->step * ( i + half ) );
+        const float* ncurr = (const float*)( p->noises->data.ptr + p->noises->step * i );
+        const float* nprev = (const float*)( p->noises->data.ptr + p->noises->step * ( i + half ) );
+        for( j = 0; j < p->num_particles; j++ )
+        {
+            float c = curr[j];
+            curr[j] = 2 * c - prev[j] + ncurr[j];
+            prev[j] = c + nprev[j];
+        }
+    }
+}
+
+/**
+ * Sparse dynamics into the back buffer
+ *
+ * particles_buf := dynamics * particles + noises using non-zeros only
+ *
+ * @param particle
+ */
+CV_INLINE void icvParticleTransitionSparse( CvParticle* p )
+{
+    const int* rows = p->dynamics_rows->data.i;
+    const int* cols = p->dynamics_cols->data.i;
+    const float* vals = p->dynamics_vals->data.fl;
+    int i, j, k;
+    for( i = 0; i < p->num_states; i++ )
+    {
+        float* dst = (float*)( p->particles_buf->data.ptr + p->particles_buf->step * i );
+        const float* noise = (const float*)( p->noises->data.ptr + p->noises->step * i );
+        for( j = 0; j < p->num_particles; j++ )
+            dst[j] = noise[j];
+        for( k = rows[i]; k < rows[i + 1]; k++ )
+        {
+            const float* src = (const float*)( p->particles->data.ptr + p->particles->step * cols[k] );
+            float v = vals[k];
+            for( j = 0; j < p->num_particles; j++ )
+                dst[j] += v * src[j];
+        }
+    }
+}
+
+/**
+ * Dense dynamics into the back buffer with a compile-time number of states
+ *
+ * particles_buf := dynamics * particles + noises, one particle at a time 
+ * with the S x S dynamics held in local memory
+ *
+ * @param particle
+ * @tparam S        number of states
+ */
+template<int S>
+inline void icvParticleTransitionDense( CvParticle* p )
+{
+    float d[S * S], x[S], v;
+    const uchar* src = p->particles->data.ptr;
+    const uchar* noise = p->noises->data.ptr;
+    uchar* dst = p->particles_buf->data.ptr;
+    int src_step = p->particles->step;
+    int noise_step = p->noises->step;
+    int dst_step = p->particles_buf->step;
+    int i, j, k;
+    for( i = 0; i < S; i++ )
+        for( k = 0; k < S; k++ )
+            d[i * S + k] = CV_MAT_ELEM( *p->dynamics, float, i, k );
+    for( j = 0; j < p->num_particles; j++ )
+    {
+        for( k = 0; k < S; k++ )
+            x[k] = ((const float*)( src + src_step * k ))[j];
+        for( i = 0; i < S; i++ )
+        {
+            v = ((const float*)( noise + noise_step * i ))[j];
+            for( k = 0; k < S; k++ )
+                v += d[i * S + k] * x[k];
+            ((float*)( dst + dst_step * i ))[j] = v;
+        }
+    }
+}
+
+/**
+ * Noise generation of cvParticleTransition and cvParticleTransitionT
+ *
+ * Analyzes p->dynamics again if it was modified directly, then 
+ * draws p->noises.
+ *
+ * @param particle
+ */
+CV_INLINE void icvParticleTransitionNoise( CvParticle* p )
+{
+    int i;
+    CvMat* noise, noisehdr;
+    double std;
+    CV_FUNCNAME( "icvParticleTransitionNoise" );
+    __BEGIN__;
+
+    // p->dynamics modified directly rather than by cvParticleSetDynamics
+    if( p->dynamics->data.ptr != p->dynamics_data ||
+        icvParticleDynamicsHash( p->dynamics ) != p->dynamics_hash )
+    {
+        CV_ASSERT( CV_MAT_TYPE( p->dynamics->type ) == CV_32FC1 &&
+                   p->dynamics->rows == p->num_states && 
+                   p->dynamics->cols == p->num_states );
+        icvParticleAnalyzeDynamics( p );
+    }
+    
+    if( p->counter_rng )
+    {
+        icvParticleCounterNoise( p );
+    }
+    else if( p->stds == NULL )
+    {
+        for( i = 0; i < p->num_states; i++ )
+        {
+            std = cvmGet( p->std, i, 0 );
+            noise = cvGetRow( p->noises, &noisehdr, i );
+            if( std == 0.0 )
+                cvZero( noise );
+            else
+                cvRandArr( &p->rng, noise, CV_RAND_NORMAL, cvScalar(0), cvScalar( std ) );
+        }
+    }
+    else
+    {
+        CvMat stdshdr;
+        CV_ASSERT( CV_MAT_TYPE( p->stds->type ) == CV_32FC1 &&
+                   p->stds->rows == p->num_states && 
+                   p->stds->cols >= p->num_particles );
+        cvGetCols( p->stds, &stdshdr, 0, p->num_particles );
+        cvRandGaussArr( &p->rng, p->noises, &stdshdr );
+    }
+    __END__;
+}
+
+/******************* Main (Related to Algorithm) *****************************/
+
+/**
+ * Initialize states
+ *
+ * If initial states are given, these states are uniformly copied.
+ * If not given, states are uniform randomly sampled within lowerbound 
+ * and upperbound regions.
+ * max_particles particles are initialized even if KLD-sampling is enabled.
+ *
+ * @param particle
+ * @param init       initial states.
+ */
+CVAPI(void) cvParticleInit( CvParticle* p, const CvParticle* init = NULL )
+{
+    int i, c, n, s;
+    icvParticleSetActive( p, p->max_particles ); // start with full particles
+    if( init ) // copy
+    {
+        int *num_copy;
+        CvMat init_particle;
+
+        int divide = p->num_particles / init->num_particles;
+        int remain = p->num_particles - divide * init->num_particles;
+        num_copy = (int*) malloc( init->num_particles * sizeof(int) );
+        for( i = 0; i < init->num_particles; i++ )
+        {
+            num_copy[i] = divide + ( i < remain ? 1 : 0 );
+        }
+        
         n = 0; // copy all states once
         for( i = 0; i < init->num_particles; i++ )
         {
@@ -426,17 +2114,11 @@ CVAPI(void) cvParticleInit( CvParticle* p, const CvParticle* init = NULL )
             {
                 if( FLT_MAX - cvmGet( init->particles, s, i ) < FLT_EPSILON ) // randomize flag
                 {
-                    CvScalar lower, upper;
-                    CvMat* statenoiseT = cvCreateMat( num_copy[i], 1, p->particles->type );
-                    lower = cvScalar( cvmGet( p->bound, s, 0 ) );
-                    upper = cvScalar( cvmGet( p->bound, s, 1 ) );
-                    cvRandArr( &p->rng, statenoiseT, CV_RAND_UNI, lower, upper );
-                    for( c = 0; c < num_copy[i]; c++ )
-                    {
-                        cvmSet( p->particles, s, n++, cvmGet( statenoiseT, c, 0 ) );
-                    }
-                    cvReleaseMat( &statenoiseT );
+                    icvParticleRandUniform( p, s, n, num_copy[i], 
+                                            cvmGet( p->bound, s, 0 ), 
+                                            cvmGet( p->bound, s, 1 ) );
                 }
+                n += num_copy[i];
             }
         }
 
@@ -444,20 +2126,14 @@ CVAPI(void) cvParticleInit( CvParticle* p, const CvParticle* init = NULL )
     } 
     else // randomize all states
     {
-        CvScalar lower, upper;
-        CvMat* statenoiseT = cvCreateMat( p->num_particles, 1, p->particles->type );
-        CvMat* statenoise  = cvCreateMat( 1, p->num_particles, p->particles->type );
         for( s = 0; s < p->num_states; s++ )
         {
-            lower = cvScalar( cvmGet( p->bound, s, 0 ) );
-            upper = cvScalar( cvmGet( p->bound, s, 1 ) );
-            cvRandArr( &p->rng, statenoiseT, CV_RAND_UNI, lower, upper );
-            cvT( statenoiseT, statenoise );
-            cvSetRow( statenoise, p->particles, s );
+            icvParticleRandUniform( p, s, 0, p->num_particles, 
+                                    cvmGet( p->bound, s, 0 ), 
+                                    cvmGet( p->bound, s, 1 ) );
         }
-        cvReleaseMat( &statenoise );
-        cvReleaseMat( &statenoiseT );
     }
+    if( p->counter_rng ) p->rng_frame++;
 }
 
 /**
@@ -471,94 +2147,153 @@ CVAPI(void) cvParticleInit( CvParticle* p, const CvParticle* init = NULL )
  * @param particle
  * @note Uses See also functions inside.
  * @see cvParticleBound
+ * @see cvParticleTransitionT for a compile-time number of states
  */
 CVAPI(void) cvParticleTransition( CvParticle* p )
 {
-    int i, j;
-    CvMat* transits = cvCreateMat( p->num_states, p->num_particles, p->particles->type );
-    CvMat* noises   = cvCreateMat( p->num_states, p->num_particles, p->particles->type );
-    CvMat* noise, noisehdr;
-    double std;
-    
-    // dynamics
-    cvMatMul( p->dynamics, p->particles, transits );
-    
-    // noise generation
-    if( p->stds == NULL )
-    {
-        for( i = 0; i < p->num_states; i++ )
-        {
-            std = cvmGet( p->std, i, 0 );
-            noise = cvGetRow( noises, &noisehdr, i );
-            if( std == 0.0 )
-                cvZero( noise );
-            else
-                cvRandArr( &p->rng, noise, CV_RAND_NORMAL, cvScalar(0), cvScalar( std ) );
-        }
-    }
-    else
+    CvMat* tmp;
+    int64 start = icvParticleProfileBegin( p );
+    CV_FUNCNAME( "cvParticleTransition" );
+    __BEGIN__;
+
+    CV_CALL( icvParticleTransitionNoise( p ) );
+
+    // dynamics + noise
+    switch( p->dynamics_type )
     {
-        for( i = 0; i < p->num_states; i++ )
-        {
-            for( j = 0; j < p->num_particles; j++ )
-            {
-                std = cvmGet( p->stds, i, j );
-                if( std == 0.0 )
-                    cvmSet( noises, i, j, 0.0 );
-                else
-                    cvmSet( noises, i, j, cvRandGauss( &p->rng, std ) );
-            }
-        }
+    case CV_PARTICLE_DYNAMICS_IDENTITY:
+        cvAdd( p->particles, p->noises, p->particles );
+        break;
+    case CV_PARTICLE_DYNAMICS_CONSTVEL:
+        icvParticleTransitionConstVel<0>( p );
+        break;
+    case CV_PARTICLE_DYNAMICS_SPARSE:
+        icvParticleTransitionSparse( p );
+        CV_SWAP( p->particles, p->particles_buf, tmp );
+        break;
+    default: // into the back buffer, then swap
+        cvMatMulAdd( p->dynamics, p->particles, p->noises, p->particles_buf );
+        CV_SWAP( p->particles, p->particles_buf, tmp );
+        break;
     }
 
-    // dynamics + noise
-    cvAdd( transits, noises, p->particles );
+    cvParticleBound( p );
+    icvParticleProfileEnd( p, CV_PARTICLE_PROFILE_TRANSITION, start );
+    __END__;
+}
 
-    cvReleaseMat( &transits );
-    cvReleaseMat( &noises );
+/**
+ * Samples new particles with a compile-time number of states
+ *
+ * Same as cvParticleTransition, but the constant velocity and dense 
+ * dynamics and the bounding run with the constant trip count S, e.g., 
+ * cvParticleTransitionT<num_states>( p ) with cvparticle/state2.h. 
+ * The dense dynamics are applied per particle instead of cvMatMulAdd. 
+ *
+ * @param particle  p->num_states must be S
+ * @see cvParticleTransition
+ */
+template<int S>
+inline void cvParticleTransitionT( CvParticle* p )
+{
+    CvMat* tmp;
+    int64 start = icvParticleProfileBegin( p );
+    CV_FUNCNAME( "cvParticleTransitionT" );
+    __BEGIN__;
+    CV_ASSERT( p->num_states == S );
 
-    cvParticleBound( p );
+    CV_CALL( icvParticleTransitionNoise( p ) );
+
+    switch( p->dynamics_type )
+    {
+    case CV_PARTICLE_DYNAMICS_IDENTITY:
+        cvAdd( p->particles, p->noises, p->particles );
+        break;
+    case CV_PARTICLE_DYNAMICS_CONSTVEL:
+        icvParticleTransitionConstVel<S>( p );
+        break;
+    case CV_PARTICLE_DYNAMICS_SPARSE:
+        icvParticleTransitionSparse( p );
+        CV_SWAP( p->particles, p->particles_buf, tmp );
+        break;
+    default:
+        icvParticleTransitionDense<S>( p );
+        CV_SWAP( p->particles, p->particles_buf, tmp );
+        break;
+    }
+
+    cvParticleBoundT<S>( p );
+    icvParticleProfileEnd( p, CV_PARTICLE_PROFILE_TRANSITION, start );
+    __END__;
 }
 
 /**
  * Re-samples a set of particles according to their weights to produce a
  * new set of unweighted particles
  *
- * Simply copy, not uniform randomly selects
+ * The method is chosen by cvParticleSetResample. The default 
+ * CV_PARTICLE_RESAMPLE_ROUND simply copies, not uniform randomly selects.
+ * Survived particles are gathered into the back buffer at once. 
+ * If KLD-sampling is enabled, the number of particles changes. 
+ * p->ids holds the ids of the survivors afterwards. 
+ * If cvParticleSetProfile is enabled, the effective sample size of the 
+ * weights and the number of distinct survivors are recorded 
+ * (p->duplicates is used as scratch). 
  *
  * @param particle
  */
 CVAPI(void) cvParticleResample( CvParticle* p )
 {
-    int i, j, np, k = 0;
-    CvMat* particle, hdr;
-    CvMat* new_particles = cvCreateMat( p->num_states, p->num_particles, p->particles->type );
-    double weight;
-    int max_loc;
-
-    k = 0;
-    for( i = 0; i < p->num_particles; i++ )
+    CvMat* tmp;
+    int n_in = p->num_particles;
+    int64 start = icvParticleProfileBegin( p );
+    if( p->profile != NULL )
+        p->profile->ess = cvParticleEffectiveSampleSize( p );
+    if( p->kld_epsilon > 0 )
     {
-        particle = cvGetCol( p->particles, &hdr, i );
-        weight = cvmGet( p->weights, 0, i );
-        weight = p->logweight ? exp( weight ) : weight;
-        np = cvRound( weight * p->num_particles );
-        for( j = 0; j < np; j++ )
-        {
-            cvSetCol( particle, new_particles, k++ );
-            if( k == p->num_particles )
-                goto exit;
-        }
+        icvParticleResampleKld( p );
     }
+    else
+    {
+        icvParticleResampleIds( &p->rng, p->resample, p->weights->data.db, p->logweight, 
+                                p->num_particles, p->cumweights->data.db, 
+                                p->ids->data.i, p->num_particles );
+        icvParticleGather( p->particles, p->particles_buf, p->ids->data.i, p->num_particles );
+        CV_SWAP( p->particles, p->particles_buf, tmp );
+    }
+    if( p->profile != NULL )
+        p->profile->unique = icvParticleCountUnique( p->ids->data.i, p->num_particles,
+                                                     p->duplicates->data.i, n_in );
+    icvParticleProfileEnd( p, CV_PARTICLE_PROFILE_RESAMPLE, start );
+}
 
-    max_loc = cvParticleGetMax( p );
-    particle = cvGetCol( p->particles, &hdr, max_loc );
-    while( k < p->num_particles )
-        cvSetCol( particle, new_particles, k++ );
-
-exit:
-    cvReleaseMat( &p->particles );
-    p->particles = new_particles;
+/**
+ * Re-samples only if the effective sample size has degenerated
+ *
+ * Resampling is skipped while ESS >= threshold * num_particles, 
+ * which saves copying states and keeps diversity of particles 
+ * when weights are nearly uniform. The current weights are then 
+ * kept and accumulated to the next weights by cvParticleNormalize. 
+ * Call after cvParticleNormalize instead of cvParticleResample.
+ *
+ * @param particle
+ * @param threshold  Ratio of ESS to num_particles, e.g., 0.5. 
+ *                   1.0 resamples always, 0.0 never. 
+ * @return 1 if resampled, 0 otherwise
+ * @see cvParticleEffectiveSampleSize
+ */
+CVAPI(int) cvParticleResampleIfNeeded( CvParticle* p, double threshold CV_DEFAULT(0.5) )
+{
+    double ess = cvParticleEffectiveSampleSize( p );
+    if( ess < threshold * p->num_particles || threshold >= 1.0 )
+    {
+        cvParticleResample( p );
+        p->has_prior = false;
+        return 1;
+    }
+    cvCopy( p->weights, p->prior_weights );
+    p->has_prior = true;
+    return 0;
 }
 
 #endif
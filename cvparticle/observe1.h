@@ -33,15 +33,60 @@
 #include "cvcropimageroi.h"
 using namespace std;
 
-/********************* Globals **********************************/
-int num_observes = 1;
-CvSize feature_size = cvSize(24, 24);
-
 /******************** Function Prototypes **********************/
 #ifndef NO_DOXYGEN
-void cvParticleObserveMeasure( CvParticle* p, IplImage* cur_frame, IplImage *pre_frame );
+void cvParticleObserveMeasure( CvParticle* p, IplImage* frame, IplImage *reference );
+double icvCropResizeNormL2( const IplImage* img, const IplImage* reference, 
+                            CvRect32f rect32f );
 #endif
 
+/**
+ * Accumulates squared differences to a reference for icvCropResizeImageROI
+ */
+struct icvSquaredDiffToReference {
+    const IplImage* reference;
+    bool round;   /**< round samples as an IPL_DEPTH_8U patch */
+    double sum;
+    void operator()( int u, int v, int ch, double val )
+    {
+        const char* row = reference->imageData + reference->widthStep * v;
+        double ref = reference->depth == IPL_DEPTH_8U ? 
+            ((const uchar*)row)[u * reference->nChannels + ch] : 
+            ((const float*)row)[u * reference->nChannels + ch];
+        double diff = ( round ? cvRound( val ) : val ) - ref;
+        sum += diff * diff;
+    }
+};
+
+/**
+ * L2 distance between a reference and a rotated rectangle region
+ *
+ * This approximates cvCropImageROI( img, patch, rect32f ), 
+ * cvResize( patch, resize ), and cvNorm( resize, reference, CV_L2 ). 
+ * Each pixel of the reference size is sampled directly from img by 
+ * icvCropResizeImageROI and the squared difference is accumulated 
+ * on the fly, so no intermediate patch is created and nothing is 
+ * allocated. Samples are rounded once (not twice) for IPL_DEPTH_8U, 
+ * and the border of the rectangle is not clamped as cvResize does. 
+ *
+ * @param img       The target image (IPL_DEPTH_8U or IPL_DEPTH_32F)
+ * @param reference The template. Same depth and channels with img
+ * @param rect32f   The rectangle region (x,y,width,height) and 
+ *                  the rotation angle in degree where the rotation center is (x,y)
+ * @return L2 distance
+ */
+double icvCropResizeNormL2( const IplImage* img, const IplImage* reference, 
+                            CvRect32f rect32f )
+{
+    icvSquaredDiffToReference diff;
+    assert( img->depth == reference->depth && img->nChannels == reference->nChannels );
+    diff.reference = reference;
+    diff.round = img->depth == IPL_DEPTH_8U;
+    diff.sum = 0;
+    icvCropResizeImageROI( img, rect32f, cvGetSize( reference ), diff );
+    return sqrt( diff.sum );
+}
+
 /**
  * Measure and weight particles. 
  *
@@ -52,37 +97,43 @@ void cvParticleObserveMeasure( CvParticle* p, IplImage* cur_frame, IplImage *pre
  *
  * CvParticleState s must have s.x, s.y, s.width, s.height, s.angle
  *
+ * Each particle is measured by icvCropResizeNormL2 which samples the 
+ * rotated box directly at the size of reference, so no patch is allocated. 
+ * Particles are measured in parallel if compiled with OpenMP 
+ * (e.g., g++ -fopenmp). 
+ * Duplicated particles are measured once if cvParticleSetCache is set. 
+ *
+ * The feature size is given by the reference, and no global is used, 
+ * so independent trackers can be measured concurrently. 
+ *
  * @param particle
  * @param frame
- * @param reference
+ * @param reference  template of the tracker, e.g., 24 x 24
  */
 void cvParticleObserveMeasure( CvParticle* p, IplImage* frame, IplImage *reference )
 {
     int i;
-    double likeli;
-    IplImage *patch;
-    IplImage *resize;
-    resize = cvCreateImage( feature_size, frame->depth, frame->nChannels );
+    int64 start = icvParticleProfileBegin( p );
+    cvParticleFindDuplicates( p );
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 16)
+#endif
     for( i = 0; i < p->num_particles; i++ ) 
     {
+        if( p->duplicates->data.i[i] != i ) continue; // cached
         CvParticleState s = cvParticleStateGet( p, i );
         CvBox32f box32f = cvBox32f( s.x, s.y, s.width, s.height, s.angle );
         CvRect32f rect32f = cvRect32fFromBox32f( box32f );
-        CvRect rect = cvRectFromRect32f( rect32f );
-        
-        patch = cvCreateImage( cvSize(rect.width,rect.height), frame->depth, frame->nChannels );
-        cvCropImageROI( frame, patch, rect32f );
-        cvResize( patch, resize );
+        double likeli;
 
         // log likeli. kinds of Gaussian model
         // exp( -d^2 / sigma^2 )
         // sigma can be omitted because common param does not affect ML estimate
-        likeli = -cvNorm( resize, reference, CV_L2 ); 
+        likeli = -icvCropResizeNormL2( frame, reference, rect32f );
         cvmSet( p->weights, 0, i, likeli );
-        
-        cvReleaseImage( &patch );
     }
-    cvReleaseImage( &resize );
+    cvParticleCopyDuplicates( p );
+    icvParticleProfileEnd( p, CV_PARTICLE_PROFILE_OBSERVE, start );
 }
 
 #endif
@@ -33,13 +33,10 @@
 #include "cvrect32f.h"
 #include "cvcropimageroi.h"
 #include "cvpcadiffs.h"
-#include "cvgaussnorm.h"
 #include <iostream>
 using namespace std;
 
 /********************************* Globals ******************************************/
-int    num_observes = 1;
-CvSize feature_size = cvSize(24, 24);
 string data_dir = "";
 string data_pcaval = "pcaval.xml";
 string data_pcavec = "pcavec.xml";
@@ -50,21 +47,171 @@ CvMat *eigenvalues;
 CvMat *eigenvectors;
 CvMat *eigenavg;
 
+/******************************* Structures ****************************************/
+
+/**
+ * Observation model context
+ *
+ * Holds everything cvParticleObserveMeasure needs so that independent 
+ * trackers can run concurrently, each with its own context. 
+ * The PCA subspace is only read, so one model can be shared among 
+ * contexts. 
+ */
+typedef struct CvParticleObservePca {
+    CvSize feature_size;             /**< Size of image patches */
+    const CvPcaDiffsModel* model;    /**< PCA subspace. Not owned */
+    IplImage* grayframe;             /**< Workspace */
+    CvMat* features;                 /**< Workspace. max_particles x D */
+    CvMat* probs;                    /**< Workspace. 1 x max_particles */
+    CvMat* proj;                     /**< Workspace. max_particles x M */
+    CvMat* ids;                      /**< Workspace. 1 x max_particles. 
+                                        Ids of particles to be measured */
+    // cascade. See cvParticleObservePcaSetCascade
+    double cascade_ratio;            /**< Fraction of particles measured by 
+                                        the PCA likelihood. 1 disables */
+    double cascade_threshold;        /**< Minimum low resolution score */
+    double cascade_floor;            /**< Log likelihood of rejected particles */
+    CvSize cascade_size;             /**< Size of low resolution patches */
+    CvMat* cascade_avg;              /**< Low resolution mean patch. 1 x d */
+    CvMat* cascade_features;         /**< Workspace. max_particles x d */
+    CvMat* cascade_scores;           /**< Workspace. 1 x max_particles */
+    CvMat* cascade_order;            /**< Workspace. 1 x max_particles */
+} CvParticleObservePca;
+
+CvPcaDiffsModel *pcamodel = NULL;           // for cvParticleObserveInitialize
+CvParticleObservePca *pcaobserve = NULL;    // for cvParticleObserveInitialize
+
 /****************************** Function Prototypes ********************************/
 #ifndef NO_DOXYGEN
-void cvParticleObserveInitialize();
+CvParticleObservePca* cvCreateParticleObservePca( CvSize feature_size, 
+                                                  const CvPcaDiffsModel* model );
+void cvReleaseParticleObservePca( CvParticleObservePca** ctx );
+void cvParticleObservePcaSetCascade( CvParticleObservePca* ctx, double keep_ratio, 
+                                     CvSize low_size, double threshold, double floorval );
+void cvParticleObserveInitialize( CvSize feature_size );
 void cvParticleObserveFinalize();
-void icvPreprocess( const IplImage* patch, CvMat *mat );
-void icvGetFeatures( const CvParticle* p, const IplImage* frame, CvMat* features );
-void cvParticleObserveMeasure( CvParticle* p, IplImage* cur_frame, IplImage *pre_frame );
+void icvPreprocess( float* feature, int D );
+void icvGetFeatures( const CvParticle* p, const IplImage* frame, CvSize feature_size, 
+                     CvMat* features, const int* ids );
+void cvParticleObserveMeasure( CvParticle* p, IplImage* frame, CvParticleObservePca* ctx );
+void cvParticleObserveMeasure( CvParticle* p, IplImage* frame );
 #endif
 
 /****************************** Functions ******************************************/
 
+/**
+ * Create an observation model context
+ *
+ * @param feature_size  Size of image patches which the PCA subspace was trained with
+ * @param model         PCA subspace created by cvCreatePcaDiffsModel. 
+ *                      Must be alive while the context is used
+ * @return CvParticleObservePca*
+ */
+CvParticleObservePca* cvCreateParticleObservePca( CvSize feature_size, 
+                                                  const CvPcaDiffsModel* model )
+{
+    CvParticleObservePca* ctx = (CvParticleObservePca*)cvAlloc( sizeof( CvParticleObservePca ) );
+    ctx->feature_size = feature_size;
+    ctx->model        = model;
+    ctx->grayframe    = NULL;
+    ctx->features     = NULL;
+    ctx->probs        = NULL;
+    ctx->proj         = NULL;
+    ctx->ids          = NULL;
+    ctx->cascade_ratio     = 1;
+    ctx->cascade_threshold = -DBL_MAX;
+    ctx->cascade_floor     = -DBL_MAX;
+    ctx->cascade_size      = cvSize( 0, 0 );
+    ctx->cascade_avg       = NULL;
+    ctx->cascade_features  = NULL;
+    ctx->cascade_scores    = NULL;
+    ctx->cascade_order     = NULL;
+    return ctx;
+}
+
+/**
+ * Release an observation model context
+ *
+ * @param ctx
+ */
+void cvReleaseParticleObservePca( CvParticleObservePca** ctx )
+{
+    if( *ctx == NULL ) return;
+    if( (*ctx)->grayframe != NULL ) cvReleaseImage( &(*ctx)->grayframe );
+    if( (*ctx)->features != NULL ) cvReleaseMat( &(*ctx)->features );
+    if( (*ctx)->probs != NULL ) cvReleaseMat( &(*ctx)->probs );
+    if( (*ctx)->proj != NULL ) cvReleaseMat( &(*ctx)->proj );
+    if( (*ctx)->ids != NULL ) cvReleaseMat( &(*ctx)->ids );
+    if( (*ctx)->cascade_avg != NULL ) cvReleaseMat( &(*ctx)->cascade_avg );
+    if( (*ctx)->cascade_features != NULL ) cvReleaseMat( &(*ctx)->cascade_features );
+    if( (*ctx)->cascade_scores != NULL ) cvReleaseMat( &(*ctx)->cascade_scores );
+    if( (*ctx)->cascade_order != NULL ) cvReleaseMat( &(*ctx)->cascade_order );
+    cvFree( ctx );
+}
+
+/**
+ * Enable a cascade which measures only promising particles by PCA
+ *
+ * Particles are first scored by the negative squared distance between 
+ * their low_size patches and the PCA mean patch reduced to low_size, 
+ * and only the selected ones by cvParticleCascadeSelect are measured 
+ * by the PCA likelihood. The others get the floor log likelihood. 
+ *
+ * @param ctx
+ * @param keep_ratio  Fraction of particles measured by PCA. 1 disables
+ * @param low_size    Size of low resolution patches, e.g., cvSize(6,6)
+ * @param threshold   Minimum score to be measured by PCA. 
+ *                    Scores are in [-4 * d, 0] (d = low_size.width * 
+ *                    low_size.height) because patches are normalized. 
+ *                    -DBL_MAX for none
+ * @param floorval    Log likelihood of rejected particles. 
+ *                    -DBL_MAX (default) to use the minimum log likelihood 
+ *                    among the measured particles
+ */
+void cvParticleObservePcaSetCascade( CvParticleObservePca* ctx, double keep_ratio, 
+                                     CvSize low_size = cvSize(6, 6), 
+                                     double threshold = -DBL_MAX, 
+                                     double floorval = -DBL_MAX )
+{
+    int fw = ctx->feature_size.width, fh = ctx->feature_size.height;
+    int d = low_size.width * low_size.height;
+    int u, v, x, y;
+    ctx->cascade_ratio     = keep_ratio;
+    ctx->cascade_threshold = threshold;
+    ctx->cascade_floor     = floorval;
+    ctx->cascade_size      = low_size;
+    if( ctx->cascade_avg != NULL ) cvReleaseMat( &ctx->cascade_avg );
+    if( ctx->cascade_features != NULL ) cvReleaseMat( &ctx->cascade_features );
+    if( keep_ratio >= 1 ) return;
+
+    // reduce the mean patch (column major) by area averaging
+    ctx->cascade_avg = cvCreateMat( 1, d, CV_32FC1 );
+    for( u = 0; u < low_size.width; u++ ) {
+        int x0 = u * fw / low_size.width, x1 = MAX( (u + 1) * fw / low_size.width, x0 + 1 );
+        for( v = 0; v < low_size.height; v++ ) {
+            int y0 = v * fh / low_size.height, y1 = MAX( (v + 1) * fh / low_size.height, y0 + 1 );
+            double sum = 0;
+            for( x = x0; x < x1; x++ )
+                for( y = y0; y < y1; y++ )
+                    sum += ctx->model->avg->data.fl[x * fh + y];
+            ctx->cascade_avg->data.fl[u * low_size.height + v] = 
+                (float)( sum / ( ( x1 - x0 ) * ( y1 - y0 ) ) );
+        }
+    }
+    icvPreprocess( ctx->cascade_avg->data.fl, d );
+}
+
 /**
  * Initialization
+ *
+ * Loads the PCA subspace from data_dir and creates a context 
+ * for cvParticleObserveMeasure( p, frame ). 
+ * Use cvCreateParticleObservePca to run several trackers. 
+ *
+ * @param feature_size  Size of image patches which the PCA subspace was 
+ *                      trained with. 24 x 24 by default
  */
-void cvParticleObserveInitialize()
+void cvParticleObserveInitialize( CvSize feature_size = cvSize( 24, 24 ) )
 {
     string filename;
     filename = data_dir + data_pcaval;
@@ -82,6 +229,8 @@ void cvParticleObserveInitialize()
         cerr << filename << " is not loadable." << endl << flush;
         exit( 1 );
     }
+    pcamodel = cvCreatePcaDiffsModel( eigenavg, eigenvalues, eigenvectors, 0 );
+    pcaobserve = cvCreateParticleObservePca( feature_size, pcamodel );
 }
 
 /**
@@ -89,6 +238,8 @@ void cvParticleObserveInitialize()
  */
 void cvParticleObserveFinalize()
 {
+    cvReleaseParticleObservePca( &pcaobserve );
+    cvReleasePcaDiffsModel( &pcamodel );
     cvReleaseMat( &eigenvalues );
     cvReleaseMat( &eigenvectors );
     cvReleaseMat( &eigenavg );
@@ -96,63 +247,78 @@ void cvParticleObserveFinalize()
 
 /**
  * Preprocess as did in training PCA subspace
+ *
+ * Zero mean and unit variance normalization (cvGaussNormImage) in place
+ *
+ * @param feature   D. feature vector
+ * @param D         dimension
  */
-void icvPreprocess( const IplImage* patch, CvMat *mat )
+void icvPreprocess( float* feature, int D )
 {
-    IplImage *gry;
-    if( patch->nChannels != 1 ) {
-        gry = cvCreateImage( cvGetSize(patch), patch->depth, 1 );
-        cvCvtColor( patch, gry, CV_BGR2GRAY );
-    } else {
-        gry = (IplImage*)patch;
+    double sum = 0, sqsum = 0, mean, std;
+    int d;
+    for( d = 0; d < D; d++ ) {
+        sum += feature[d];
+        sqsum += (double)feature[d] * feature[d];
+    }
+    mean = sum / D;
+    std = sqrt( MAX( sqsum / D - mean * mean, 0 ) );
+    if( std == 0 ) std = 1; // flat patch
+    for( d = 0; d < D; d++ ) {
+        feature[d] = (float)( ( feature[d] - mean ) / std );
     }
-    IplImage *resize = cvCreateImage( cvSize(mat->rows, mat->cols), patch->depth, 1 );
-
-    cvResize( gry, resize );
-    cvConvert( resize, mat );
-    cvImgGaussNorm( mat, mat );
-
-    cvReleaseImage( &resize );
-    if( gry != patch )
-        cvReleaseImage( &gry );
 }
 
+/**
+ * Writes samples of icvCropResizeImageROI in the column major order
+ */
+struct icvColumnMajorFeature {
+    float* data;
+    int height;
+    void operator()( int u, int v, int ch, double val )
+    {
+        data[u * height + v] = (float)val;
+    }
+};
+
 /**
  * Get observation features
  *
  * CvParticleState must have x, y, width, height, angle
+ *
+ * Each rotated box is sampled directly at feature_size from a gray 
+ * frame by icvCropResizeImageROI (approximates cvCropImageROI and cvResize) 
+ * and written into a row of features in the column major order 
+ * (the same with matlab's reshape), then normalized by icvPreprocess. 
+ * Particles are processed in parallel if compiled with OpenMP 
+ * (e.g., g++ -fopenmp). 
+ *
+ * @param p         particles
+ * @param frame     gray image (IPL_DEPTH_8U or IPL_DEPTH_32F)
+ * @param feature_size  size of image patches
+ * @param features  N x D (32F). feature vectors of particles
+ * @param ids       N. ids of particles to extract features. 
+ *                  NULL for all particles (N = num_particles). 
  */
-void icvGetFeatures( const CvParticle* p, const IplImage* frame, CvMat* features )
+void icvGetFeatures( const CvParticle* p, const IplImage* frame, CvSize feature_size, 
+                     CvMat* features, const int* ids )
 {
     int feature_height = feature_size.height;
     int feature_width  = feature_size.width;
-    //cvNamedWindow( "patch" );
-    CvMat* normed = cvCreateMat( feature_height, feature_width, CV_64FC1 );
-    CvMat* normedT = cvCreateMat( feature_width, feature_height, CV_64FC1 );
-    CvMat* feature, featurehdr;
-    IplImage *patch;
-    for( int n = 0; n < p->num_particles; n++ ) {
-        CvParticleState s = cvParticleStateGet( p, n );
+    int n;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 16)
+#endif
+    for( n = 0; n < features->rows; n++ ) {
+        CvParticleState s = cvParticleStateGet( p, ids ? ids[n] : n );
         CvBox32f box32f = cvBox32f( s.x, s.y, s.width, s.height, s.angle );
         CvRect32f rect32f = cvRect32fFromBox32f( box32f );
-
-        // get image patch and preprocess
-        patch = cvCreateImage( cvSize( cvRound( s.width ), cvRound( s.height ) ), 
-                               frame->depth, frame->nChannels );
-        cvCropImageROI( (IplImage*)frame, patch, rect32f );
-        //cvShowImage( "patch", patch );
-        //cvWaitKey( 10 );
-        icvPreprocess( patch, normed );
-        cvReleaseImage( &patch );
-
-        // vectorize
-        cvT( normed, normedT ); // transpose to make the same with matlab's reshape
-        feature = cvReshape( normedT, &featurehdr, 1, feature_height * feature_width );
-
-        cvSetCol( feature, features, n );
+        icvColumnMajorFeature feature;
+        feature.data = (float*)( features->data.ptr + features->step * n );
+        feature.height = feature_height;
+        icvCropResizeImageROI( frame, rect32f, feature_size, feature );
+        icvPreprocess( feature.data, feature_height * feature_width );
     }
-    cvReleaseMat( &normedT );
-    cvReleaseMat( &normed );
 }
 
 /**
@@ -165,21 +331,122 @@ void icvGetFeatures( const CvParticle* p, const IplImage* frame, CvMat* features
  *
  * CvParticleState s must have s.x, s.y, s.width, s.height, s.angle
  *
+ * Features of all particles are stored in a contiguous matrix and 
+ * projected onto the PCA subspace at once (cvPcaDiffsModelProbs). 
+ * If cvParticleObservePcaSetCascade is enabled, only the particles 
+ * selected by low resolution patches are measured. 
+ *
  * @param particle
  * @param frame
- * @param reference
+ * @param ctx       observation model context. Only one thread may use a 
+ *                  context at a time
  */
-void cvParticleObserveMeasure( CvParticle* p, IplImage* frame )
+void cvParticleObserveMeasure( CvParticle* p, IplImage* frame, CvParticleObservePca* ctx )
 {
-    int feature_height = feature_size.height;
-    int feature_width  = feature_size.width;
+    int D = ctx->feature_size.height * ctx->feature_size.width;
+    int n, u, num_measure;
+    CvMat ids, features, probs;
+    const IplImage* gray = frame;
+    int64 start = icvParticleProfileBegin( p );
 
-    // extract features from particle states
-    CvMat* features = cvCreateMat( feature_height*feature_width, p->num_particles, CV_64FC1 );
-    icvGetFeatures( p, frame, features );
+    // workspaces
+    if( ctx->features == NULL || ctx->features->rows < p->max_particles ) {
+        if( ctx->features != NULL ) cvReleaseMat( &ctx->features );
+        if( ctx->probs != NULL ) cvReleaseMat( &ctx->probs );
+        if( ctx->proj != NULL ) cvReleaseMat( &ctx->proj );
+        if( ctx->ids != NULL ) cvReleaseMat( &ctx->ids );
+        ctx->features = cvCreateMat( p->max_particles, D, CV_32FC1 );
+        ctx->probs = cvCreateMat( 1, p->max_particles, CV_64FC1 );
+        ctx->ids = cvCreateMat( 1, p->max_particles, CV_32SC1 );
+        if( ctx->model->M > 0 )
+            ctx->proj = cvCreateMat( p->max_particles, ctx->model->M, CV_32FC1 );
+    }
+    if( ctx->cascade_ratio < 1 && 
+        ( ctx->cascade_features == NULL || ctx->cascade_features->rows < p->max_particles ) ) {
+        if( ctx->cascade_features != NULL ) cvReleaseMat( &ctx->cascade_features );
+        if( ctx->cascade_scores != NULL ) cvReleaseMat( &ctx->cascade_scores );
+        if( ctx->cascade_order != NULL ) cvReleaseMat( &ctx->cascade_order );
+        ctx->cascade_features = cvCreateMat( p->max_particles, ctx->cascade_avg->cols, CV_32FC1 );
+        ctx->cascade_scores = cvCreateMat( 1, p->max_particles, CV_64FC1 );
+        ctx->cascade_order = cvCreateMat( 1, p->max_particles, CV_32SC1 );
+    }
+    if( frame->nChannels != 1 ) {
+        IplImage* grayframe = ctx->grayframe;
+        if( grayframe == NULL || grayframe->width != frame->width || 
+            grayframe->height != frame->height || grayframe->depth != frame->depth ) {
+            if( grayframe != NULL ) cvReleaseImage( &grayframe );
+            grayframe = ctx->grayframe = cvCreateImage( cvGetSize(frame), frame->depth, 1 );
+        }
+        cvCvtColor( frame, grayframe, CV_BGR2GRAY );
+        gray = grayframe;
+    }
+
+    // measure only one of duplicated particles (cvParticleSetCache)
+    int num_unique = cvParticleFindDuplicates( p );
+    cvGetCols( ctx->ids, &ids, 0, num_unique );
+    for( n = 0, u = 0; n < p->num_particles; n++ ) {
+        if( p->duplicates->data.i[n] == n )
+            ids.data.i[u++] = n;
+    }
+
+    // cascade: select particles by low resolution patches
+    num_measure = num_unique;
+    if( ctx->cascade_ratio < 1 ) {
+        int d = ctx->cascade_avg->cols;
+        const float* avg = ctx->cascade_avg->data.fl;
+        double* scores = ctx->cascade_scores->data.db;
+        int* order = ctx->cascade_order->data.i;
+        CvMat lowfeatures;
+        cvGetRows( ctx->cascade_features, &lowfeatures, 0, num_unique );
+        icvGetFeatures( p, gray, ctx->cascade_size, &lowfeatures, ids.data.i );
+        for( u = 0; u < num_unique; u++ ) {
+            const float* f = (const float*)( lowfeatures.data.ptr + lowfeatures.step * u );
+            double dist = 0;
+            for( int k = 0; k < d; k++ )
+                dist += ( f[k] - avg[k] ) * ( f[k] - avg[k] );
+            scores[u] = -dist;
+        }
+        num_measure = cvParticleCascadeSelect( scores, num_unique, ctx->cascade_ratio, 
+                                               ctx->cascade_threshold, order );
+        for( u = 0; u < num_unique; u++ ) // selected ones first
+            order[u] = ids.data.i[order[u]];
+        memcpy( ids.data.i, order, num_unique * sizeof( int ) );
+    }
+
+    if( num_measure > 0 ) {
+        // extract features from particle states
+        cvGetRows( ctx->features, &features, 0, num_measure );
+        icvGetFeatures( p, gray, ctx->feature_size, &features, ids.data.i );
     
-    // Likelihood measurments
-    cvMatPcaDiffs( features, eigenavg, eigenvalues, eigenvectors, p->weights, 0, TRUE);
+        // Likelihood measurments
+        cvGetCols( ctx->probs, &probs, 0, num_measure );
+        cvPcaDiffsModelProbs( ctx->model, &features, &probs, true, ctx->proj );
+        for( u = 0; u < num_measure; u++ ) {
+            p->weights->data.db[ids.data.i[u]] = probs.data.db[u];
+        }
+    }
+    if( num_measure < num_unique ) { // rejected by the cascade
+        double floorval = ctx->cascade_floor;
+        if( floorval == -DBL_MAX ) {
+            for( u = 0; u < num_measure; u++ )
+                floorval = u == 0 ? probs.data.db[u] : MIN( floorval, probs.data.db[u] );
+        }
+        for( u = num_measure; u < num_unique; u++ )
+            p->weights->data.db[ids.data.i[u]] = floorval;
+    }
+    cvParticleCopyDuplicates( p );
+    icvParticleProfileEnd( p, CV_PARTICLE_PROFILE_OBSERVE, start );
+}
+
+/**
+ * Measure and weight particles with the context of cvParticleObserveInitialize
+ *
+ * @param particle
+ * @param frame
+ */
+void cvParticleObserveMeasure( CvParticle* p, IplImage* frame )
+{
+    cvParticleObserveMeasure( p, frame, pcaobserve );
 }
 
 #endif
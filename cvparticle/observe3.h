@@ -0,0 +1,263 @@
+/** @file
+ *
+ * Rectangle region statistics observation model for particle filter
+ *
+ * A rectangle is described by mean colors of grid x grid cells and
+ * standard deviations of colors of the whole rectangle, which are
+ * computed from integral images in O(grid * grid) per particle
+ * regardless of the rectangle size.
+ * CvParticleState s must have s.x, s.y, s.width, s.height.
+ * s.angle is ignored (axis-aligned rectangles).
+ */
+/* The MIT License
+ *
+ * Copyright (c) 2008, Naotoshi Seo <sonots(at)sonots.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef CV_PARTICLE_OBSERVE_INTEGRAL_H
+#define CV_PARTICLE_OBSERVE_INTEGRAL_H
+
+#include "cvparticle.h"
+#include "cvrect32f.h"
+using namespace std;
+
+/******************************* Structures ****************************************/
+
+/**
+ * Observation model context
+ *
+ * Integral images are built once per frame by cvParticleObserveIntegralUpdate
+ * and shared by all particles (and trackers) measured on the frame.
+ */
+typedef struct CvParticleObserveIntegral {
+    int grid;              /**< Number of cells in each side of a rectangle */
+    double sigma;          /**< Standard deviation of descriptor differences */
+    int nChannels;         /**< Number of channels of frames */
+    IplImage* sum;         /**< (width + 1) x (height + 1), IPL_DEPTH_64F.
+                              Integral image of the frame */
+    IplImage* sqsum;       /**< (width + 1) x (height + 1), IPL_DEPTH_64F.
+                              Integral image of the squared frame */
+    CvMat* reference;      /**< 1 x D, CV_64FC1. Descriptor of the target.
+                              D = ( grid * grid + 1 ) * nChannels */
+} CvParticleObserveIntegral;
+
+/****************************** Function Prototypes ********************************/
+#ifndef NO_DOXYGEN
+CvParticleObserveIntegral* cvCreateParticleObserveIntegral( int grid, double sigma );
+void cvReleaseParticleObserveIntegral( CvParticleObserveIntegral** ctx );
+void cvParticleObserveIntegralUpdate( CvParticleObserveIntegral* ctx, const IplImage* frame );
+double icvRectDescriptor( const CvParticleObserveIntegral* ctx, CvRect rect, 
+                          double* desc, const double* reference );
+void cvParticleObserveIntegralSetReference( CvParticleObserveIntegral* ctx, CvRect rect );
+void cvParticleObserveMeasure( CvParticle* p, CvParticleObserveIntegral* ctx );
+#endif
+
+/****************************** Functions ******************************************/
+
+/**
+ * Create an observation model context
+ *
+ * @param grid   Number of cells in each side of a rectangle, e.g., 2
+ * @param sigma  Standard deviation of differences of mean colors, e.g., 16
+ * @return CvParticleObserveIntegral*
+ */
+CvParticleObserveIntegral* cvCreateParticleObserveIntegral( int grid = 2,
+                                                            double sigma = 16 )
+{
+    CvParticleObserveIntegral* ctx =
+        (CvParticleObserveIntegral*)cvAlloc( sizeof( CvParticleObserveIntegral ) );
+    ctx->grid      = grid;
+    ctx->sigma     = sigma;
+    ctx->nChannels = 0;
+    ctx->sum       = NULL;
+    ctx->sqsum     = NULL;
+    ctx->reference = NULL;
+    return ctx;
+}
+
+/**
+ * Release an observation model context
+ *
+ * @param ctx
+ */
+void cvReleaseParticleObserveIntegral( CvParticleObserveIntegral** ctx )
+{
+    if( *ctx == NULL ) return;
+    if( (*ctx)->sum != NULL ) cvReleaseImage( &(*ctx)->sum );
+    if( (*ctx)->sqsum != NULL ) cvReleaseImage( &(*ctx)->sqsum );
+    if( (*ctx)->reference != NULL ) cvReleaseMat( &(*ctx)->reference );
+    cvFree( ctx );
+}
+
+/**
+ * Build integral images of a frame
+ *
+ * Call once per frame before cvParticleObserveMeasure.
+ *
+ * @param ctx
+ * @param frame  IPL_DEPTH_8U or IPL_DEPTH_32F, 1 to 4 channels
+ */
+void cvParticleObserveIntegralUpdate( CvParticleObserveIntegral* ctx, const IplImage* frame )
+{
+    CvSize size = cvSize( frame->width + 1, frame->height + 1 );
+    if( ctx->sum == NULL || ctx->sum->width != size.width ||
+        ctx->sum->height != size.height || ctx->nChannels != frame->nChannels ) {
+        if( ctx->sum != NULL ) cvReleaseImage( &ctx->sum );
+        if( ctx->sqsum != NULL ) cvReleaseImage( &ctx->sqsum );
+        ctx->sum = cvCreateImage( size, IPL_DEPTH_64F, frame->nChannels );
+        ctx->sqsum = cvCreateImage( size, IPL_DEPTH_64F, frame->nChannels );
+        ctx->nChannels = frame->nChannels;
+    }
+    cvIntegral( frame, ctx->sum, ctx->sqsum );
+}
+
+/**
+ * Sum of a channel in a rectangle [x0, x1) x [y0, y1) from an integral image
+ */
+CV_INLINE double icvIntegralRectSum( const IplImage* sum, int ch,
+                                     int x0, int y0, int x1, int y1 )
+{
+    const double* r0 = (const double*)( sum->imageData + sum->widthStep * y0 );
+    const double* r1 = (const double*)( sum->imageData + sum->widthStep * y1 );
+    int cn = sum->nChannels;
+    return r1[x1 * cn + ch] - r1[x0 * cn + ch] - r0[x1 * cn + ch] + r0[x0 * cn + ch];
+}
+
+/**
+ * Descriptor of a rectangle
+ *
+ * Mean colors of grid x grid cells (row major) followed by standard
+ * deviations of colors of the whole rectangle. The rectangle is clipped
+ * by the frame. The squared distance to a reference descriptor is 
+ * accumulated on the fly, so measurement needs no buffer. 
+ *
+ * @param ctx
+ * @param rect      rectangle
+ * @param desc      D = ( grid * grid + 1 ) * nChannels. output. 
+ *                  NULL not to store
+ * @param reference D. descriptor to compute the distance to. 
+ *                  NULL to return 0
+ * @return squared distance to the reference. 
+ *         -1 if the rectangle is outside of the frame
+ */
+double icvRectDescriptor( const CvParticleObserveIntegral* ctx, CvRect rect, 
+                          double* desc, const double* reference )
+{
+    int grid = ctx->grid, cn = ctx->nChannels;
+    int x0 = MAX( rect.x, 0 ), y0 = MAX( rect.y, 0 );
+    int x1 = MIN( rect.x + rect.width, ctx->sum->width - 1 );
+    int y1 = MIN( rect.y + rect.height, ctx->sum->height - 1 );
+    int gx, gy, ch, d = 0;
+    double area, mean, sq, val, dist = 0;
+    if( x1 - x0 < grid || y1 - y0 < grid ) return -1;
+    for( gy = 0; gy < grid; gy++ ) {
+        int cy0 = y0 + ( y1 - y0 ) * gy / grid, cy1 = y0 + ( y1 - y0 ) * ( gy + 1 ) / grid;
+        for( gx = 0; gx < grid; gx++ ) {
+            int cx0 = x0 + ( x1 - x0 ) * gx / grid, cx1 = x0 + ( x1 - x0 ) * ( gx + 1 ) / grid;
+            area = (double)( cx1 - cx0 ) * ( cy1 - cy0 );
+            for( ch = 0; ch < cn; ch++, d++ ) {
+                val = icvIntegralRectSum( ctx->sum, ch, cx0, cy0, cx1, cy1 ) / area;
+                if( desc ) desc[d] = val;
+                if( reference ) dist += ( val - reference[d] ) * ( val - reference[d] );
+            }
+        }
+    }
+    area = (double)( x1 - x0 ) * ( y1 - y0 );
+    for( ch = 0; ch < cn; ch++, d++ ) {
+        mean = icvIntegralRectSum( ctx->sum, ch, x0, y0, x1, y1 ) / area;
+        sq = icvIntegralRectSum( ctx->sqsum, ch, x0, y0, x1, y1 ) / area;
+        val = sqrt( MAX( sq - mean * mean, 0 ) );
+        if( desc ) desc[d] = val;
+        if( reference ) dist += ( val - reference[d] ) * ( val - reference[d] );
+    }
+    return dist;
+}
+
+/**
+ * Set the target by a rectangle on the frame of the last
+ * cvParticleObserveIntegralUpdate
+ *
+ * @param ctx
+ * @param rect   rectangle of the target
+ */
+void cvParticleObserveIntegralSetReference( CvParticleObserveIntegral* ctx, CvRect rect )
+{
+    int D = ( ctx->grid * ctx->grid + 1 ) * ctx->nChannels;
+    if( ctx->reference != NULL ) cvReleaseMat( &ctx->reference );
+    ctx->reference = cvCreateMat( 1, D, CV_64FC1 );
+    if( icvRectDescriptor( ctx, rect, ctx->reference->data.db, NULL ) < 0 )
+        cvZero( ctx->reference );
+}
+
+/**
+ * Measure and weight particles.
+ *
+ * The proposal function q is set p(xt|xt-1) in SIR/Condensation, and it results
+ * that "weights" are set to be proportional to the likelihood probability
+ * (Normalize later).
+ * Rewrite here if you want to use a different proposal function q.
+ *
+ * CvParticleState s must have s.x, s.y, s.width, s.height
+ *
+ * The log likelihood is -|desc - reference|^2 / (2 sigma^2), written as is 
+ * if p->logweight, or as exp() of it otherwise.
+ * Rectangles outside of the frame get -DBL_MAX (log) or 0 (linear).
+ * Particles are measured in parallel if compiled with OpenMP
+ * (e.g., g++ -fopenmp).
+ * Duplicated particles are measured once if cvParticleSetCache is set.
+ *
+ * @param particle
+ * @param ctx       observation model context updated by
+ *                  cvParticleObserveIntegralUpdate for the current frame.
+ *                  The reference must have been set by
+ *                  cvParticleObserveIntegralSetReference.
+ *                  Only read, so trackers on the same frame can share it
+ *                  if they track the same target model
+ */
+void cvParticleObserveMeasure( CvParticle* p, CvParticleObserveIntegral* ctx )
+{
+    int i;
+    int64 start = icvParticleProfileBegin( p );
+    CV_FUNCNAME( "cvParticleObserveMeasure" );
+    __BEGIN__;
+    CV_ASSERT( ctx->sum != NULL && ctx->reference != NULL );
+    CV_ASSERT( ctx->reference->cols == ( ctx->grid * ctx->grid + 1 ) * ctx->nChannels );
+    cvParticleFindDuplicates( p );
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 64)
+#endif
+    for( i = 0; i < p->num_particles; i++ )
+    {
+        if( p->duplicates->data.i[i] != i ) continue; // cached
+        CvParticleState s = cvParticleStateGet( p, i );
+        CvRect rect = cvRectFromBox32f( cvBox32f( s.x, s.y, s.width, s.height, 0 ) );
+        double dist = icvRectDescriptor( ctx, rect, NULL, ctx->reference->data.db );
+        double loglike = dist < 0 ? -DBL_MAX : -dist / ( 2 * ctx->sigma * ctx->sigma );
+        if( p->logweight )
+            p->weights->data.db[i] = loglike;
+        else
+            p->weights->data.db[i] = dist < 0 ? 0.0 : exp( loglike );
+    }
+    cvParticleCopyDuplicates( p );
+    icvParticleProfileEnd( p, CV_PARTICLE_PROFILE_OBSERVE, start );
+    __END__;
+}
+
+#endif
@@ -44,7 +44,7 @@ using namespace std;
 
 /********************** Definition of a particle *****************************/
 
-int num_states = 5;
+const int num_states = 5;
 
 // Definition of meanings of 5 states.
 // This kinds of structures is not necessary to be defined, 
@@ -60,7 +60,7 @@ typedef struct CvParticleState {
 // Definition of dynamics model
 // new_particle = cvMatMul( dynamics, particle ) + noise
 // curr_x =: curr_x + noise
-double dynamics[] = {
+const double dynamics[] = {
     1, 0, 0, 0, 0, 
     0, 1, 0, 0, 0, 
     0, 0, 1, 0, 0, 
@@ -149,9 +149,9 @@ void cvParticleStateToMat( const CvParticleState& state, CvMat* state_mat )
  */
 CvParticleState cvParticleStateGet( const CvParticle* p, int p_id )
 {
-    CvMat* state, hdr;
-    state = cvGetCol( p->particles, &hdr, p_id );
-    return cvParticleStateFromMat( state );
+    double s[num_states];
+    cvParticleGetStates<num_states>( p, p_id, s );
+    return cvParticleState( s[0], s[1], s[2], s[3], s[4] );
 }
 
 /**
@@ -164,9 +164,8 @@ CvParticleState cvParticleStateGet( const CvParticle* p, int p_id )
  */
 void cvParticleStateSet( CvParticle* p, int p_id, const CvParticleState& state )
 {
-    CvMat* state_mat, hdr;
-    state_mat = cvGetCol( p->particles, &hdr, p_id );
-    cvParticleStateToMat( state, state_mat );
+    double s[] = { state.x, state.y, state.width, state.height, state.angle };
+    cvParticleSetStates<num_states>( p, p_id, s );
 }
 
 /*************************** Particle Filter Configuration *********************************/
@@ -177,7 +176,7 @@ void cvParticleStateSet( CvParticle* p, int p_id, const CvParticleState& state )
 void cvParticleStateConfig( CvParticle* p, CvSize imsize, CvParticleState& std )
 {
     // config dynamics model
-    CvMat dynamicsmat = cvMat( p->num_states, p->num_states, CV_64FC1, dynamics );
+    CvMat dynamicsmat = cvMat( p->num_states, p->num_states, CV_64FC1, (void*)dynamics );
 
     // config random noise standard deviation
     CvRNG rng = cvRNG( time( NULL ) );
@@ -204,25 +203,28 @@ void cvParticleStateConfig( CvParticle* p, CvSize imsize, CvParticleState& std )
     cvParticleSetDynamics( p, &dynamicsmat );
     cvParticleSetNoise( p, rng, &stdmat );
     cvParticleSetBound( p, &boundmat );
+    // width <= imsize.width - x, height <= imsize.height - y
+    cvParticleSetBoundLinear( p, 2, 0, -1, imsize.width );
+    cvParticleSetBoundLinear( p, 3, 1, -1, imsize.height );
 }
 
 /**
- * @todo
- * CvParticle does not support this type of bounding currently
- * Call after transition
+ * Bound width and height by x and y
+ *
+ * cvParticleStateConfig registers these bounds with cvParticleSetBoundLinear
+ * so that cvParticleTransition applies them. Needed only if the bounds of 
+ * the CvParticle were set without cvParticleStateConfig. 
  */
 void cvParticleStateAdditionalBound( CvParticle* p, CvSize imsize )
 {
+    const float* x = (const float*)( p->particles->data.ptr + p->particles->step * 0 );
+    const float* y = (const float*)( p->particles->data.ptr + p->particles->step * 1 );
+    float* width   = (float*)( p->particles->data.ptr + p->particles->step * 2 );
+    float* height  = (float*)( p->particles->data.ptr + p->particles->step * 3 );
     for( int np = 0; np < p->num_particles; np++ ) 
     {
-        double x      = cvmGet( p->particles, 0, np );
-        double y      = cvmGet( p->particles, 1, np );
-        double width  = cvmGet( p->particles, 2, np );
-        double height = cvmGet( p->particles, 3, np );
-        width = MIN( width, imsize.width - x ); // another state x is used
-        height = MIN( height, imsize.height - y ); // another state y is used
-        cvmSet( p->particles, 2, np, width );
-        cvmSet( p->particles, 3, np, height );
+        width[np] = MIN( width[np], imsize.width - x[np] ); // another state x is used
+        height[np] = MIN( height[np], imsize.height - y[np] ); // another state y is used
     }
 }
 
@@ -20,7 +20,32 @@
 #ifndef CV_PCADIFFS_INCLUDED
 #define CV_PCADIFFS_INCLUDED
 
+/**
+ * Precomputed PCA subspace for batched cvPcaDiffsModelProbs
+ *
+ * The constants of cvMatPcaDiffs which depend only on the subspace are 
+ * computed once by cvCreatePcaDiffsModel. The model is not modified 
+ * by cvPcaDiffsModelProbs, so one model can be shared among threads. 
+ */
+typedef struct CvPcaDiffsModel {
+    int D;                   /**< Dimension of feature vectors */
+    int M;                   /**< Number of principal components */
+    int normalize;           /**< normalize parameter of cvMatPcaDiffs */
+    CvMat* avg;              /**< 1 x D mean vector (32F) */
+    CvMat* eigenvectorsT;    /**< D x M pre-transposed eigen vectors (32F) */
+    CvMat* inv_sqrt_lambda;  /**< 1 x M 1 / sqrt( eigenvalues ) */
+    double rho;              /**< Average of residual eigen values. 0 if none */
+    double normterm;         /**< Normalization term (normalize == 1) */
+} CvPcaDiffsModel;
+
 #ifndef NO_DOXYGEN
+CVAPI(CvPcaDiffsModel*) 
+cvCreatePcaDiffsModel( const CvMat* avg, const CvMat* eigenvalues, 
+                       const CvMat* eigenvectors, int normalize );
+CVAPI(void) cvReleasePcaDiffsModel( CvPcaDiffsModel** model );
+CVAPI(void) 
+cvPcaDiffsModelProbs( const CvPcaDiffsModel* model, CvMat* samples, CvMat* probs, 
+                      bool logprob, CvMat* proj );
 CVAPI(void) 
 cvMatPcaDiffs( const CvMat* samples, const CvMat* avg, const CvMat* eigenvalues, 
                const CvMat* eigenvectors, CvMat* probs, 
@@ -42,7 +67,8 @@ cvPcaDiffs( const CvMat* sample, const CvMat* avg, const CvMat* eigenvalues,
  *   See [1] for more details. 
  *
  * @param samples             D x N sample vectors
- * @param avg                 D x 1 mean vector
+ * @param avg                 D x 1 mean vector. Converted to the type of 
+ *                            samples if it differs
  * @param eigenvalues         nEig x 1 eigen values
  * @param eigenvectors        M x D or D x M (automatically adjusted) eigen vectors
  * @param probs               1 x N computed likelihood probabilities
@@ -98,6 +124,7 @@ cvMatPcaDiffs( const CvMat* samples, const CvMat* avg, const CvMat* eigenvalues,
     CvMat *subsamples0, subsamples0hdr;
     CvScalar rho;
     CvMat *_proj;
+    CvMat *_avg = (CvMat*)avg; // avg in the type of samples
     CV_FUNCNAME( "cvMatPcaDiffs" );
     __BEGIN__;
     CV_ASSERT( CV_IS_MAT(samples) );
@@ -117,11 +144,16 @@ cvMatPcaDiffs( const CvMat* samples, const CvMat* avg, const CvMat* eigenvalues,
     } else {
         _eigenvectors = (CvMat*)eigenvectors;
     }
+    if( CV_MAT_TYPE( avg->type ) != CV_MAT_TYPE( type ) ) {
+        _avg = cvCreateMat( D, 1, CV_MAT_TYPE( type ) );
+        cvConvert( avg, _avg );
+    }
     //cvProjectPCA( samples, avg, _eigenvectors, proj );
     for( n = 0; n < N; n++ ) { // want mean subtracted samples for laster too
-        for( d = 0; d < D; d++ ) {
-            cvmSet( samples0, d, n, cvmGet( samples, d, n ) - cvmGet( avg, d, 0 ) );
-        }
+        CvMat samplecol, samples0col;
+        cvGetCol( samples, &samplecol, n );
+        cvGetCol( samples0, &samples0col, n );
+        cvSub( &samplecol, _avg, &samples0col );
     }
     _proj = cvCreateMat( M, N, type );
     cvMatMul( _eigenvectors, samples0, _proj );
@@ -195,6 +227,9 @@ cvMatPcaDiffs( const CvMat* samples, const CvMat* avg, const CvMat* eigenvalues,
     cvReleaseMat( &DIFS );
     cvReleaseMat( &DFFS );
     cvReleaseMat( &samples0 );
+    if( _avg != avg ) {
+        cvReleaseMat( &_avg );
+    }
     if( D == eigenvectors->rows ) {
         cvReleaseMat( &_eigenvectors );
     }
@@ -230,5 +265,174 @@ cvPcaDiffs( const CvMat* sample, const CvMat* avg, const CvMat* eigenvalues,
     return prob;
 }
 
+/**
+ * Precompute a PCA subspace for cvPcaDiffsModelProbs
+ *
+ * @param avg                 D x 1 mean vector
+ * @param eigenvalues         nEig x 1 eigen values
+ * @param eigenvectors        M x D or D x M (automatically adjusted) eigen vectors
+ * @param normalize           Compute normalization term or not. See cvMatPcaDiffs
+ * @return CvPcaDiffsModel*
+ * @see cvMatPcaDiffs
+ */
+CVAPI(CvPcaDiffsModel*) 
+cvCreatePcaDiffsModel( const CvMat* avg, const CvMat* eigenvalues, 
+                       const CvMat* eigenvectors, int normalize CV_DEFAULT(1) )
+{
+    CvPcaDiffsModel* model = NULL;
+    int D = avg->rows;
+    int M = (eigenvectors->rows == D) ? eigenvectors->cols : eigenvectors->rows;
+    int nEig = eigenvalues->rows;
+    int d;
+    CV_FUNCNAME( "cvCreatePcaDiffsModel" );
+    __BEGIN__;
+    CV_ASSERT( CV_IS_MAT(avg) && avg->cols == 1 );
+    CV_ASSERT( CV_IS_MAT(eigenvalues) && CV_IS_MAT(eigenvectors) );
+    CV_ASSERT( D == eigenvectors->rows || D == eigenvectors->cols );
+    CV_ASSERT( M <= nEig );
+    model = (CvPcaDiffsModel*)cvAlloc( sizeof( CvPcaDiffsModel ) );
+    model->D = D;
+    model->M = M;
+    model->normalize = normalize;
+    model->avg = cvCreateMat( 1, D, CV_32FC1 );
+    model->eigenvectorsT = cvCreateMat( D, M, CV_32FC1 );
+    model->inv_sqrt_lambda = cvCreateMat( 1, MAX(M,1), CV_64FC1 );
+    model->rho = 0;
+    model->normterm = 0;
+
+    for( d = 0; d < D; d++ )
+        CV_MAT_ELEM( *model->avg, float, 0, d ) = (float)cvmGet( avg, d, 0 );
+    if( D == eigenvectors->rows )
+        cvConvert( eigenvectors, model->eigenvectorsT );
+    else
+        cvT( eigenvectors, model->eigenvectorsT );
+
+    for( d = 0; d < M; d++ ) {
+        double sqrt_lambda = sqrt( cvmGet( eigenvalues, d, 0 ) );
+        model->inv_sqrt_lambda->data.db[d] = 1.0 / sqrt_lambda;
+        model->normterm += log( sqrt_lambda );
+    }
+    if( M > 0 )
+        model->normterm += log(2*M_PI)*(M/2.0);
+    if( nEig > M ) {
+        for( d = M; d < nEig; d++ )
+            model->rho += cvmGet( eigenvalues, d, 0 );
+        model->rho /= nEig - M;
+        model->normterm += log(2*M_PI*model->rho) * ((nEig - M)/2.0);
+    }
+    if( normalize != 1 )
+        model->normterm = 0;
+    __END__;
+    return model;
+}
+
+/**
+ * Release a CvPcaDiffsModel
+ *
+ * @param model
+ */
+CVAPI(void) cvReleasePcaDiffsModel( CvPcaDiffsModel** model )
+{
+    CV_FUNCNAME( "cvReleasePcaDiffsModel" );
+    __BEGIN__;
+    if( !model ) CV_ERROR( CV_StsNullPtr, "" );
+    if( !*model ) EXIT;
+    cvReleaseMat( &(*model)->avg );
+    cvReleaseMat( &(*model)->eigenvectorsT );
+    cvReleaseMat( &(*model)->inv_sqrt_lambda );
+    cvFree( model );
+    __END__;
+}
+
+/**
+ * Batched PCA Distance "in" and "from" feature space
+ *
+ * Same with cvMatPcaDiffs, but samples are row vectors so that each of 
+ * them is contiguous, and all samples are projected by one GEMM against 
+ * the pre-transposed eigen vectors of the model. 
+ *
+ * @param model               Precomputed PCA subspace
+ * @param samples             N x D sample vectors (32F). 
+ *                            Overwritten by mean subtracted samples
+ * @param probs               1 x N computed likelihood probabilities (64F)
+ * @param logprob             Log probability or not
+ * @param projbuf             Workspace of at least N x M (32F) for projections. 
+ *                            NULL allocates it temporarily
+ * @see cvMatPcaDiffs
+ * @see cvCreatePcaDiffsModel
+ */
+CVAPI(void) 
+cvPcaDiffsModelProbs( const CvPcaDiffsModel* model, CvMat* samples, CvMat* probs, 
+                      bool logprob CV_DEFAULT(false), CvMat* projbuf CV_DEFAULT(NULL) )
+{
+    int N = samples->rows;
+    int D = model->D;
+    int M = model->M;
+    int n, d;
+    CvMat proj;
+    CvMat* _projbuf = NULL;
+    CV_FUNCNAME( "cvPcaDiffsModelProbs" );
+    __BEGIN__;
+    CV_ASSERT( CV_MAT_TYPE(samples->type) == CV_32FC1 && samples->cols == D );
+    CV_ASSERT( CV_MAT_TYPE(probs->type) == CV_64FC1 );
+    CV_ASSERT( 1 == probs->rows && N == probs->cols );
+    if( N == 0 ) EXIT;
+
+    // mean subtraction and ||x0||^2 in one pass
+    for( n = 0; n < N; n++ ) {
+        float* x = (float*)( samples->data.ptr + samples->step * n );
+        const float* a = model->avg->data.fl;
+        double sq = 0;
+        for( d = 0; d < D; d++ ) {
+            x[d] -= a[d];
+            sq += (double)x[d] * x[d];
+        }
+        probs->data.db[n] = sq;
+    }
+
+    // one GEMM for all samples
+    if( M > 0 ) {
+        if( projbuf == NULL )
+            projbuf = _projbuf = cvCreateMat( N, M, CV_32FC1 );
+        CV_ASSERT( projbuf->rows >= N && projbuf->cols == M );
+        cvGetRows( projbuf, &proj, 0, N );
+        cvMatMul( samples, model->eigenvectorsT, &proj );
+    }
+
+    for( n = 0; n < N; n++ ) {
+        const float* y = (M > 0) ? (const float*)( proj.data.ptr + proj.step * n ) : NULL;
+        const double* isl = model->inv_sqrt_lambda->data.db;
+        double difs = 0, projsq = 0, dffs = 0, v;
+        for( d = 0; d < M; d++ ) {
+            v = y[d] * isl[d];
+            difs += v * v;
+            projsq += (double)y[d] * y[d];
+        }
+        if( model->rho > 0 )
+            dffs = ( probs->data.db[n] - projsq ) / model->rho;
+        probs->data.db[n] = difs / (-2) + dffs / (-2) - model->normterm;
+    }
+
+    // normalization and so on
+    if( model->normalize == 2 ) {
+        double minval, maxval;
+        cvMinMaxLoc( probs, &minval, &maxval );
+        cvSubS( probs, cvScalar( maxval ), probs );
+    }
+    if( !logprob || model->normalize == 2 ) {
+        cvExp( probs, probs );
+        if( model->normalize == 2 ) {
+            CvScalar sumprob = cvSum( probs );
+            cvScale( probs, probs, 1.0 / sumprob.val[0] );
+        }
+    }
+    if( logprob && model->normalize == 2 ) {
+        cvLog( probs, probs );
+    }
+    __END__;
+    if( _projbuf != NULL )
+        cvReleaseMat( &_projbuf );
+}
+
 
 #endif
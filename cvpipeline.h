@@ -0,0 +1,306 @@
+/** @file
+ * Pipelined frame processing (capture, track, render)
+ *
+ * Capturing of frame t + 1, tracking of frame t, and rendering of
+ * frame t - 1 run concurrently on three threads connected by bounded
+ * single-producer single-consumer lock-free queues. Frame buffers are
+ * recycled, so no image is allocated per frame.
+ *
+ * Requires C++11 threads (e.g., g++ -std=c++11 -pthread).
+ *
+ * Example)
+ * @code
+ * bool capture( CvPipelineFrame* f, void* userdata ) {
+ *     IplImage* frame = cvQueryFrame( (CvCapture*)userdata );
+ *     if( frame == NULL ) return false;
+ *     if( f->frame == NULL ) f->frame = cvCloneImage( frame );
+ *     else cvCopy( frame, f->frame );
+ *     return true;
+ * }
+ * bool track( CvPipelineFrame* f, void* userdata ) {
+ *     cvParticleTransition( p );
+ *     cvParticleObserveMeasure( p, f->frame, ... );
+ *     cvParticleNormalize( p );
+ *     *(CvParticleState*)f->result = cvParticleStateGet( p, cvParticleGetMax( p ) );
+ *     cvParticleResample( p );
+ *     return true;
+ * }
+ * bool render( CvPipelineFrame* f, void* userdata ) {
+ *     cvParticleStateDisplay( *(CvParticleState*)f->result, f->frame, CV_RGB(255,0,0) );
+ *     cvShowImage( "Select an initial state", f->frame );
+ *     return cvWaitKey( 1 ) != '\x1b';
+ * }
+ * CvPipelineStats stats = cvRunPipeline( capture, track, render, video,
+ *                                        3, sizeof( CvParticleState ) );
+ * cvPrintPipelineStats( stats );
+ * @endcode
+ */
+/* The MIT License
+ *
+ * Copyright (c) 2008, Naotoshi Seo <sonots(at)sonots.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef CV_PIPELINE_INCLUDED
+#define CV_PIPELINE_INCLUDED
+
+#include "cv.h"
+#include "cvaux.h"
+#include "cxcore.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <thread>
+
+/******************************* Structures **********************************/
+
+/**
+ * A frame passed through the pipeline
+ */
+typedef struct CvPipelineFrame {
+    IplImage* frame;   /**< Frame image. Allocated by the capture stage at
+                          the first use and reused. Released by cvRunPipeline */
+    int index;         /**< Frame number */
+    void* result;      /**< result_size bytes. Written by the track stage
+                          and read by the render stage */
+    int64 ticks[6];    /**< cvGetTickCount at the start and the end of 
+                          capture, track, and render */
+    bool skip;         /**< Discarded by the track stage. The render 
+                          thread only recycles it */
+} CvPipelineFrame;
+
+/**
+ * A stage of the pipeline
+ *
+ * @param frame     frame
+ * @param userdata  userdata given to cvRunPipeline
+ * @return false to stop the pipeline (e.g., end of video, ESC key)
+ */
+typedef bool (*CvPipelineFunc)( CvPipelineFrame* frame, void* userdata );
+
+/**
+ * Statistics of cvRunPipeline
+ */
+typedef struct CvPipelineStats {
+    int frames;             /**< Number of rendered frames */
+    double capture_ms;      /**< Average time of the capture stage */
+    double track_ms;        /**< Average time of the track stage */
+    double render_ms;       /**< Average time of the render stage */
+    double latency_ms;      /**< Average time from capture to the end of render */
+    double max_latency_ms;  /**< Maximum time from capture to the end of render */
+    double fps;             /**< Throughput (frames per second) */
+} CvPipelineStats;
+
+/**
+ * Bounded single-producer single-consumer lock-free queue of pointers
+ */
+typedef struct CvPipelineQueue {
+    void** items;
+    int size;                  /**< capacity + 1 */
+    std::atomic<int> head;     /**< next to pop. Written by the consumer */
+    std::atomic<int> tail;     /**< next to push. Written by the producer */
+} CvPipelineQueue;
+
+/**************************** Function Prototypes ****************************/
+#ifndef NO_DOXYGEN
+CvPipelineStats cvRunPipeline( CvPipelineFunc capture, CvPipelineFunc track,
+                               CvPipelineFunc render, void* userdata,
+                               int num_buffers, size_t result_size );
+void cvPrintPipelineStats( const CvPipelineStats& stats );
+#endif
+
+/****************************** Functions ************************************/
+
+CV_INLINE void icvPipelineQueueInit( CvPipelineQueue* q, void** items, int capacity )
+{
+    q->items = items;
+    q->size = capacity + 1;
+    q->head.store( 0 );
+    q->tail.store( 0 );
+}
+
+/**
+ * Push an item. Waits while the queue is full
+ */
+CV_INLINE void icvPipelinePush( CvPipelineQueue* q, void* item )
+{
+    int tail = q->tail.load( std::memory_order_relaxed );
+    int next = ( tail + 1 ) % q->size;
+    while( next == q->head.load( std::memory_order_acquire ) )
+        std::this_thread::yield();
+    q->items[tail] = item;
+    q->tail.store( next, std::memory_order_release );
+}
+
+/**
+ * Pop an item. Waits while the queue is empty
+ */
+CV_INLINE void* icvPipelinePop( CvPipelineQueue* q )
+{
+    int head = q->head.load( std::memory_order_relaxed );
+    void* item;
+    while( head == q->tail.load( std::memory_order_acquire ) )
+        std::this_thread::yield();
+    item = q->items[head];
+    q->head.store( ( head + 1 ) % q->size, std::memory_order_release );
+    return item;
+}
+
+/**
+ * Run capture, track, and render stages in a pipeline
+ *
+ * capture and track run on their own threads, and render runs on the
+ * calling thread (GUI functions such as cvShowImage must be called
+ * from it on some platforms). Stages process frames in order.
+ * When capture returns false (end of video), the frames in flight are 
+ * processed and the pipeline ends. When track or render returns false, 
+ * the frames in flight are discarded.
+ * Only the render thread pushes frames back to the free queue (frames 
+ * discarded by track are passed on with "skip"), so every queue has a 
+ * single producer and a single consumer.
+ *
+ * @param capture     capture stage. Fill frame->frame
+ * @param track       track stage. Write frame->result
+ * @param render      render stage
+ * @param userdata    passed to the stages
+ * @param num_buffers Number of recycled frames ( >= 1. >= 3 to overlap 3 stages )
+ * @param result_size Size of frame->result
+ * @return statistics
+ */
+CvPipelineStats cvRunPipeline( CvPipelineFunc capture, CvPipelineFunc track,
+                               CvPipelineFunc render, void* userdata,
+                               int num_buffers = 3, size_t result_size = 0 )
+{
+    CvPipelineStats stats;
+    CvPipelineFrame* frames;
+    void** items;
+    CvPipelineQueue free_queue, track_queue, render_queue;
+    std::atomic<bool> stop( false );
+    double freq = cvGetTickFrequency() * 1000; // ticks per msec
+    double latency;
+    int64 start = cvGetTickCount(), end;
+    int i;
+    CV_FUNCNAME( "cvRunPipeline" );
+
+    memset( &stats, 0, sizeof( stats ) );
+    __BEGIN__;
+    CV_ASSERT( num_buffers >= 1 ); // capture would wait for a free frame forever
+    __END__;
+    if( num_buffers < 1 ) return stats;
+
+    frames = (CvPipelineFrame*)cvAlloc( num_buffers * sizeof( CvPipelineFrame ) );
+    items = (void**)cvAlloc( 3 * ( num_buffers + 2 ) * sizeof( void* ) );
+    icvPipelineQueueInit( &free_queue, items, num_buffers + 1 );
+    icvPipelineQueueInit( &track_queue, items + num_buffers + 2, num_buffers + 1 );
+    icvPipelineQueueInit( &render_queue, items + 2 * ( num_buffers + 2 ), num_buffers + 1 );
+    for( i = 0; i < num_buffers; i++ )
+    {
+        frames[i].frame = NULL;
+        frames[i].result = result_size > 0 ? cvAlloc( result_size ) : NULL;
+        icvPipelinePush( &free_queue, &frames[i] );
+    }
+
+    // NULL is passed downstream as the end of frames
+    std::thread capture_thread( [&]() {
+        for( int index = 0; ; index++ )
+        {
+            CvPipelineFrame* f = (CvPipelineFrame*)icvPipelinePop( &free_queue );
+            f->index = index;
+            f->ticks[0] = cvGetTickCount();
+            if( stop.load() || !capture( f, userdata ) )
+                break; // frames in flight are still processed
+            f->ticks[1] = cvGetTickCount();
+            icvPipelinePush( &track_queue, f );
+        }
+        icvPipelinePush( &track_queue, NULL );
+    } );
+    std::thread track_thread( [&]() {
+        CvPipelineFrame* f;
+        while( ( f = (CvPipelineFrame*)icvPipelinePop( &track_queue ) ) != NULL )
+        {
+            f->ticks[2] = cvGetTickCount();
+            f->skip = stop.load() || !track( f, userdata );
+            if( f->skip )
+                stop.store( true ); // recycled by the render thread
+            f->ticks[3] = cvGetTickCount();
+            icvPipelinePush( &render_queue, f );
+        }
+        icvPipelinePush( &render_queue, NULL );
+    } );
+
+    CvPipelineFrame* f;
+    while( ( f = (CvPipelineFrame*)icvPipelinePop( &render_queue ) ) != NULL )
+    {
+        if( f->skip || stop.load() ) // discard
+        {
+            icvPipelinePush( &free_queue, f );
+            continue;
+        }
+        f->ticks[4] = cvGetTickCount();
+        if( !render( f, userdata ) )
+            stop.store( true );
+        f->ticks[5] = cvGetTickCount();
+        stats.frames++;
+        stats.capture_ms += ( f->ticks[1] - f->ticks[0] ) / freq;
+        stats.track_ms   += ( f->ticks[3] - f->ticks[2] ) / freq;
+        stats.render_ms  += ( f->ticks[5] - f->ticks[4] ) / freq;
+        latency = ( f->ticks[5] - f->ticks[0] ) / freq; // including waits in queues
+        stats.latency_ms += latency;
+        stats.max_latency_ms = MAX( stats.max_latency_ms, latency );
+        icvPipelinePush( &free_queue, f );
+    }
+    capture_thread.join();
+    track_thread.join();
+    end = cvGetTickCount();
+
+    if( stats.frames > 0 )
+    {
+        stats.capture_ms /= stats.frames;
+        stats.track_ms   /= stats.frames;
+        stats.render_ms  /= stats.frames;
+        stats.latency_ms /= stats.frames;
+        stats.fps = stats.frames / ( ( end - start ) / freq / 1000 );
+    }
+    for( i = 0; i < num_buffers; i++ )
+    {
+        if( frames[i].frame != NULL ) cvReleaseImage( &frames[i].frame );
+        if( frames[i].result != NULL ) cvFree( &frames[i].result );
+    }
+    cvFree( &frames );
+    cvFree( &items );
+    return stats;
+}
+
+/**
+ * Print statistics of cvRunPipeline
+ *
+ * @param stats
+ */
+void cvPrintPipelineStats( const CvPipelineStats& stats )
+{
+    printf( "frames %d, %.1f fps\n", stats.frames, stats.fps );
+    printf( "capture %.2f ms, track %.2f ms, render %.2f ms per frame\n",
+            stats.capture_ms, stats.track_ms, stats.render_ms );
+    printf( "latency %.2f ms (max %.2f ms)\n", stats.latency_ms, stats.max_latency_ms );
+    fflush( stdout );
+}
+
+
+#endif
@@ -36,13 +36,62 @@
  */
 CV_INLINE double cvRandGauss( CvRNG* rng, double sigma )
 {
-    CvMat* mat = cvCreateMat( 1, 1, CV_64FC1 );
     double var = 0;
-    cvRandArr( rng, mat, CV_RAND_NORMAL, cvRealScalar(0), cvRealScalar(sigma) );
-    var = cvmGet( mat, 0, 0 );
-    cvReleaseMat( &mat );
+    CvMat mat = cvMat( 1, 1, CV_64FC1, &var );
+    cvRandArr( rng, &mat, CV_RAND_NORMAL, cvRealScalar(0), cvRealScalar(sigma) );
     return var;
 }
+
+/**
+ * Fill an array with Gaussian random variates of mean zero and 
+ * element-wise standard deviations. 
+ *
+ * All variates are drawn by one cvRandArr call and scaled by one cvMul, 
+ * rather than calling cvRandGauss for each element. If the type of sigma 
+ * differs from arr, sigma is converted once by cvConvert into buf. 
+ *
+ * @param rng    cvRNG random state
+ * @param arr    output array
+ * @param sigma  standard deviations. The same size with arr. 
+ *               NULL for 1.0 (standard normal)
+ * @param buf    scratch of the same size and type with arr, used only if 
+ *               the type of sigma differs. Allocated inside if NULL.
+ */
+CV_INLINE void cvRandGaussArr( CvRNG* rng, CvArr* arr, const CvArr* sigma CV_DEFAULT(NULL),
+                               CvArr* buf CV_DEFAULT(NULL) )
+{
+    CvMat stub, *mat;
+    CvMat sigstub, *sig = NULL;
+    CvMat bufstub, *conv = NULL, *tmp = NULL;
+    CV_FUNCNAME( "cvRandGaussArr" );
+    __BEGIN__;
+    CV_CALL( mat = cvGetMat( arr, &stub ) );
+    if( sigma != NULL )
+    {
+        CV_CALL( sig = cvGetMat( sigma, &sigstub ) );
+        CV_ASSERT( sig->rows == mat->rows && sig->cols == mat->cols );
+    }
+    cvRandArr( rng, mat, CV_RAND_NORMAL, cvRealScalar(0), cvRealScalar(1) );
+    if( sig == NULL ) EXIT;
+    if( CV_MAT_TYPE(sig->type) != CV_MAT_TYPE(mat->type) ) // different depths
+    {
+        if( buf != NULL )
+        {
+            CV_CALL( conv = cvGetMat( buf, &bufstub ) );
+            CV_ASSERT( CV_ARE_SIZES_EQ( conv, mat ) && CV_ARE_TYPES_EQ( conv, mat ) );
+        }
+        else
+        {
+            CV_CALL( conv = tmp = cvCreateMat( mat->rows, mat->cols, CV_MAT_TYPE(mat->type) ) );
+        }
+        cvConvert( sig, conv );
+        sig = conv;
+    }
+    cvMul( mat, sig, mat );
+    __END__;
+    if( tmp != NULL ) cvReleaseMat( &tmp );
+}
+
 /*
 rng.disttype = CV_RAND_NORMAL;
 cvRandSetRange( &rng, 30, 100, -1 ); */
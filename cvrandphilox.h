@@ -0,0 +1,117 @@
+/** @file
+ * Counter-based random numbers (Philox4x32-10)
+ *
+ * A random number is a pure function of (key, counter), so arrays can be
+ * filled by any number of threads in any order with identical results.
+ *
+ * References
+ * @verbatim
+ *   [1] @INPROCEEDINGS{Salmon11parallelrandom,
+ *     author = {John K. Salmon and Mark A. Moraes and Ron O. Dror and David E. Shaw},
+ *     title = {Parallel random numbers: as easy as 1, 2, 3},
+ *     booktitle = {Proceedings of the International Conference for High
+ *                  Performance Computing, Networking, Storage and Analysis (SC11)},
+ *     year = {2011}
+ *   }
+ * @endverbatim
+ */
+/* The MIT License
+*
+* Copyright (c) 2008, Naotoshi Seo <sonots(at)sonots.com>
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+#ifndef CV_RANDPHILOX_INCLUDED
+#define CV_RANDPHILOX_INCLUDED
+
+#include "cv.h"
+#include "cvaux.h"
+#include <math.h>
+
+/**
+ * Philox4x32-10 block function
+ *
+ * @param ctr  128 bits counter
+ * @param key  64 bits key
+ * @param out  128 bits random output
+ */
+CV_INLINE void cvPhilox4x32( const unsigned int ctr[4], const unsigned int key[2],
+                             unsigned int out[4] )
+{
+    unsigned int c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+    unsigned int k0 = key[0], k1 = key[1];
+    uint64 p0, p1;
+    int r;
+    for( r = 0; r < 10; r++ )
+    {
+        p0 = (uint64)0xD2511F53u * c0;
+        p1 = (uint64)0xCD9E8D57u * c2;
+        c0 = (unsigned int)( p1 >> 32 ) ^ c1 ^ k0;
+        c2 = (unsigned int)( p0 >> 32 ) ^ c3 ^ k1;
+        c1 = (unsigned int)p1;
+        c3 = (unsigned int)p0;
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+    }
+    out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+}
+
+/**
+ * Uniform random variate in (0, 1) from a 32 bits random integer
+ */
+CV_INLINE double cvPhiloxToReal( unsigned int x )
+{
+    return ( x + 0.5 ) * 2.3283064365386962890625e-10; // 2^-32
+}
+
+/**
+ * Uniform random variate in (0, 1) keyed on (seed, ctr)
+ *
+ * @param seed  64 bits key
+ * @param ctr   128 bits counter, e.g., (particle, state, frame, stream)
+ * @return double
+ */
+CV_INLINE double cvRandPhiloxReal( uint64 seed, const unsigned int ctr[4] )
+{
+    unsigned int key[2] = { (unsigned int)seed, (unsigned int)( seed >> 32 ) };
+    unsigned int out[4];
+    cvPhilox4x32( ctr, key, out );
+    return cvPhiloxToReal( out[0] );
+}
+
+/**
+ * Gaussian random variate with mean zero and standard deviation sigma
+ * keyed on (seed, ctr) (Box-Muller transform)
+ *
+ * @param seed  64 bits key
+ * @param ctr   128 bits counter, e.g., (particle, state, frame, stream)
+ * @param sigma standard deviation
+ * @return double
+ */
+CV_INLINE double cvRandPhiloxGauss( uint64 seed, const unsigned int ctr[4], double sigma )
+{
+    unsigned int key[2] = { (unsigned int)seed, (unsigned int)( seed >> 32 ) };
+    unsigned int out[4];
+    cvPhilox4x32( ctr, key, out );
+    return sigma * sqrt( -2.0 * log( cvPhiloxToReal( out[0] ) ) )
+        * cos( 2.0 * CV_PI * cvPhiloxToReal( out[1] ) );
+}
+
+
+#endif
@@ -35,4 +35,20 @@ public:
         CvScalar logsum = cvLogSum( &mat );
         TS_ASSERT_DELTA( exp( logsum.val[0] ),  7.67, 0.0001 );
     }
+
+    void testLogSumExp()
+    {
+        // exp of these underflows; more than one block with rising maximum
+        double x[200];
+        float y[200];
+        for( int i = 0; i < 200; i++ )
+            y[i] = (float)( x[i] = -1000 + i * 0.01 );
+        double expected = -1000 + 1.99 + log( ( 1 - exp( -2.0 ) ) / ( 1 - exp( -0.01 ) ) );
+        TS_ASSERT_DELTA( cvLogSumExp( x, 200 ), expected, 1e-9 );
+        TS_ASSERT_DELTA( cvLogSumExp( y, 200 ), expected, 1e-3 );
+        CvMat mat = cvMat( 1, 200, CV_64FC1, x );
+        TS_ASSERT_DELTA( cvLogSum( &mat ).val[0], expected, 1e-9 );
+        cvLogNormalize( x, 200 );
+        TS_ASSERT_DELTA( cvLogSumExp( x, 200 ), 0, 1e-9 );
+    }
 };
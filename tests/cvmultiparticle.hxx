@@ -0,0 +1,141 @@
+#ifdef _MSC_VER
+#pragma warning(disable:4996)
+#pragma comment(lib, "cv.lib")
+#pragma comment(lib, "cxcore.lib")
+#pragma comment(lib, "cvaux.lib")
+#pragma comment(lib, "highgui.lib")
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "cv.h"
+#include "cvaux.h"
+#include "cxcore.h"
+#include "highgui.h"
+#include "cvmultiparticle.h"
+
+#include <cxxtest/TestSuite.h>
+
+class CvMultiParticleTest : public CxxTest::TestSuite
+{
+public:
+    void testTarget()
+    {
+        CvMultiParticle* mp = cvCreateMultiParticle( 2, 3, 4 );
+        for( int i = 0; i < 12; i++ )
+        {
+            cvmSet( mp->p->particles, 0, i, i );
+            cvmSet( mp->p->particles, 1, i, -i );
+        }
+        CvParticle* target = cvMultiParticleTarget( mp, 1 );
+        TS_ASSERT_EQUALS( target->num_particles, 4 );
+        TS_ASSERT_DELTA( cvmGet( target->particles, 0, 0 ), 4, 0.0001 );
+        TS_ASSERT_DELTA( cvmGet( target->particles, 1, 3 ), -7, 0.0001 );
+        cvReleaseMultiParticle( &mp );
+        TS_ASSERT( mp == NULL );
+    }
+
+    void testNormalizeResample()
+    {
+        // each target has all weight on one particle
+        CvMultiParticle* mp = cvCreateMultiParticle( 1, 3, 4, true );
+        for( int i = 0; i < 12; i++ )
+        {
+            cvmSet( mp->p->particles, 0, i, i );
+            cvmSet( mp->p->weights, 0, i, ( i % 4 == i / 4 ) ? 0 : -1000 );
+        }
+        cvMultiParticleNormalize( mp );
+        for( int t = 0; t < 3; t++ )
+        {
+            CvParticle* target = cvMultiParticleTarget( mp, t );
+            TS_ASSERT_DELTA( cvmGet( target->weights, 0, t ), 0, 0.0001 );
+            TS_ASSERT_EQUALS( cvParticleGetMax( target ), t );
+        }
+        cvMultiParticleResample( mp );
+        for( int t = 0; t < 3; t++ )
+            for( int i = 0; i < 4; i++ )
+                TS_ASSERT_DELTA( cvmGet( mp->p->particles, 0, t * 4 + i ), t * 4 + t, 0.0001 );
+        cvReleaseMultiParticle( &mp );
+    }
+
+    void testNormalizePriorZero()
+    {
+        // target 0: prior * weights. target 1: all zero likelihoods
+        CvMultiParticle* mp = cvCreateMultiParticle( 1, 2, 4 );
+        cvParticleSetProfile( mp->p );
+        for( int i = 0; i < 8; i++ )
+        {
+            cvmSet( mp->p->weights, 0, i, i < 4 ? 1 : 0 );
+            cvmSet( mp->p->prior_weights, 0, i, i < 4 ? i : 1 );
+        }
+        mp->p->has_prior = true;
+        cvMultiParticleNormalize( mp );
+        TS_ASSERT( !mp->p->has_prior );
+        for( int i = 0; i < 4; i++ )
+        {
+            TS_ASSERT_DELTA( cvmGet( mp->p->weights, 0, i ), i / 6.0, 1e-9 );
+            TS_ASSERT_DELTA( cvmGet( mp->p->weights, 0, 4 + i ), 0.25, 1e-9 );
+        }
+        TS_ASSERT_EQUALS( mp->p->profile->calls[CV_PARTICLE_PROFILE_NORMALIZE], 1 );
+        cvMultiParticleResample( mp );
+        // ESS of target 0 is 36 / 14
+        TS_ASSERT_DELTA( mp->p->profile->ess, 36.0 / 14.0, 1e-9 );
+        cvReleaseMultiParticle( &mp );
+    }
+
+    void testResampleIfNeeded()
+    {
+        // target 0 degenerated (ESS 1), target 1 uniform (ESS 4)
+        CvMultiParticle* mp = cvCreateMultiParticle( 1, 2, 4 );
+        for( int i = 0; i < 8; i++ )
+        {
+            cvmSet( mp->p->particles, 0, i, i );
+            cvmSet( mp->p->weights, 0, i, i < 4 ? ( i == 2 ? 1 : 0 ) : 1 );
+        }
+        cvMultiParticleNormalize( mp );
+        TS_ASSERT_EQUALS( cvMultiParticleResampleIfNeeded( mp, 0.5 ), 1 );
+        TS_ASSERT( mp->p->has_prior );
+        for( int i = 0; i < 4; i++ )
+        {
+            TS_ASSERT_DELTA( cvmGet( mp->p->particles, 0, i ), 2, 0.0001 );
+            TS_ASSERT_DELTA( cvmGet( mp->p->particles, 0, 4 + i ), 4 + i, 0.0001 );
+        }
+        // only the kept target accumulates its previous weights
+        for( int i = 0; i < 8; i++ )
+            cvmSet( mp->p->weights, 0, i, i < 4 ? 1 : i - 3 );
+        cvMultiParticleNormalize( mp );
+        TS_ASSERT( !mp->p->has_prior );
+        for( int i = 0; i < 4; i++ )
+        {
+            TS_ASSERT_DELTA( cvmGet( mp->p->weights, 0, i ), 0.25, 1e-9 );
+            TS_ASSERT_DELTA( cvmGet( mp->p->weights, 0, 4 + i ), ( i + 1 ) / 10.0, 1e-9 );
+        }
+        TS_ASSERT_EQUALS( cvMultiParticleResampleIfNeeded( mp, 1.0 ), 2 );
+        TS_ASSERT( !mp->p->has_prior );
+        cvReleaseMultiParticle( &mp );
+    }
+
+    void testInitTransition()
+    {
+        double boundarr[] = { 0, 10, 0 };
+        CvMat bound = cvMat( 1, 3, CV_64FC1, boundarr );
+        double stdarr[] = { 0 };
+        CvMat std = cvMat( 1, 1, CV_64FC1, stdarr );
+        CvMultiParticle* mp = cvCreateMultiParticle( 1, 2, 50 );
+        cvParticleSetBound( mp->p, &bound );
+        cvParticleSetNoise( mp->p, cvRNG( 1 ), &std );
+        CvParticle* init = cvCreateParticle( 1, 1 );
+        cvmSet( init->particles, 0, 0, 5 );
+        cvMultiParticleInit( mp, NULL );
+        cvMultiParticleInit( mp, init, 1 );
+        cvMultiParticleTransition( mp );
+        for( int i = 0; i < 100; i++ )
+        {
+            double v = cvmGet( mp->p->particles, 0, i );
+            TS_ASSERT( 0 <= v && v <= 10 );
+            if( i >= 50 ) TS_ASSERT_DELTA( v, 5, 0.0001 );
+        }
+        cvReleaseParticle( &init );
+        cvReleaseMultiParticle( &mp );
+    }
+};
@@ -0,0 +1,715 @@
+#ifdef _MSC_VER
+#pragma warning(disable:4996)
+#pragma comment(lib, "cv.lib")
+#pragma comment(lib, "cxcore.lib")
+#pragma comment(lib, "cvaux.lib")
+#pragma comment(lib, "highgui.lib")
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "cv.h"
+#include "cvaux.h"
+#include "cxcore.h"
+#include "highgui.h"
+#include "cvparticle.h"
+#include "cvparticle/state1.h"
+#include "cvparticle/observe1.h"
+#include "cvparticle/observe3.h"
+
+#include <cxxtest/TestSuite.h>
+
+class CvParticleTest : public CxxTest::TestSuite
+{
+public:
+    // particle i has state i and weight w[i]
+    CvParticle* createParticle( const double* w, int num, bool logweight = false )
+    {
+        CvParticle* p = cvCreateParticle( 1, num, logweight );
+        for( int i = 0; i < num; i++ )
+        {
+            cvmSet( p->particles, 0, i, i );
+            cvmSet( p->weights, 0, i, logweight ? log( w[i] ) : w[i] );
+        }
+        return p;
+    }
+
+    void testResampleRound()
+    {
+        double w[] = { 0.5, 0.25, 0.25, 0 };
+        CvParticle* p = createParticle( w, 4 );
+        cvParticleResample( p );
+        TS_ASSERT_DELTA( cvmGet( p->particles, 0, 0 ), 0, 0.0001 );
+        TS_ASSERT_DELTA( cvmGet( p->particles, 0, 1 ), 0, 0.0001 );
+        TS_ASSERT_DELTA( cvmGet( p->particles, 0, 2 ), 1, 0.0001 );
+        TS_ASSERT_DELTA( cvmGet( p->particles, 0, 3 ), 2, 0.0001 );
+        cvReleaseParticle( &p );
+    }
+
+    void testResampleMethods()
+    {
+        int methods[] = {
+            CV_PARTICLE_RESAMPLE_ROUND,
+            CV_PARTICLE_RESAMPLE_SYSTEMATIC,
+            CV_PARTICLE_RESAMPLE_STRATIFIED,
+            CV_PARTICLE_RESAMPLE_RESIDUAL,
+            CV_PARTICLE_RESAMPLE_MULTINOMIAL
+        };
+        double w[] = { log(0.1), log(0.0), log(0.6), log(0.3) };
+        double cumweights[4];
+        int ids[1000];
+        CvRNG rng = cvRNG( 1 );
+        for( int m = 0; m < 5; m++ )
+        {
+            int count[4] = { 0, 0, 0, 0 };
+            icvParticleResampleIds( &rng, methods[m], w, true, 4, cumweights, ids, 1000 );
+            for( int i = 0; i < 1000; i++ )
+            {
+                TS_ASSERT( 0 <= ids[i] && ids[i] < 4 );
+                count[ids[i]]++;
+            }
+            TS_ASSERT_EQUALS( count[1], 0 );
+            TS_ASSERT_DELTA( count[0], 100, 40 );
+            TS_ASSERT_DELTA( count[2], 600, 60 );
+            TS_ASSERT_DELTA( count[3], 300, 60 );
+        }
+    }
+
+    void testResampleSystematicExact()
+    {
+        // systematic and residual never deviate more than 1 from num * weight
+        double w[] = { 0.125, 0.375, 0.5 };
+        int methods[] = { CV_PARTICLE_RESAMPLE_SYSTEMATIC, CV_PARTICLE_RESAMPLE_RESIDUAL };
+        for( int m = 0; m < 2; m++ )
+        {
+            int count[3] = { 0, 0, 0 };
+            CvParticle* q = cvCreateParticle( 1, 8 );
+            for( int i = 0; i < 8; i++ )
+            {
+                cvmSet( q->particles, 0, i, i % 3 );
+                cvmSet( q->weights, 0, i, w[i % 3] );
+            }
+            cvParticleSetResample( q, methods[m] );
+            cvParticleResample( q );
+            for( int i = 0; i < 8; i++ )
+                count[cvRound( cvmGet( q->particles, 0, i ) )]++;
+            TS_ASSERT_EQUALS( count[0] + count[1] + count[2], 8 );
+            TS_ASSERT_LESS_THAN_EQUALS( count[2], 5 );
+            TS_ASSERT_LESS_THAN_EQUALS( 3, count[2] );
+            cvReleaseParticle( &q );
+        }
+    }
+
+    void testEffectiveSampleSize()
+    {
+        double u[] = { 0.25, 0.25, 0.25, 0.25 };
+        double d[] = { 1, 0, 0, 0 };
+        CvParticle* p = createParticle( u, 4 );
+        TS_ASSERT_DELTA( cvParticleEffectiveSampleSize( p ), 4, 0.0001 );
+        cvReleaseParticle( &p );
+        p = createParticle( u, 4, true );
+        TS_ASSERT_DELTA( cvParticleEffectiveSampleSize( p ), 4, 0.0001 );
+        cvReleaseParticle( &p );
+        p = createParticle( d, 4, true );
+        TS_ASSERT_DELTA( cvParticleEffectiveSampleSize( p ), 1, 0.0001 );
+        cvReleaseParticle( &p );
+    }
+
+    void testResampleIfNeeded()
+    {
+        double u[] = { 0.25, 0.25, 0.25, 0.25 };
+        double d[] = { 0.01, 0.01, 0.97, 0.01 };
+        CvParticle* p = createParticle( u, 4, true );
+        TS_ASSERT_EQUALS( cvParticleResampleIfNeeded( p, 0.5 ), 0 );
+        TS_ASSERT( p->has_prior );
+        // weights of the skipped frame are carried over
+        for( int i = 0; i < 4; i++ )
+            cvmSet( p->weights, 0, i, log( d[i] ) );
+        cvParticleNormalize( p );
+        TS_ASSERT( !p->has_prior );
+        TS_ASSERT_DELTA( exp( cvmGet( p->weights, 0, 2 ) ), 0.97, 0.0001 );
+        TS_ASSERT_EQUALS( cvParticleResampleIfNeeded( p, 0.5 ), 1 );
+        for( int i = 0; i < 4; i++ )
+            TS_ASSERT_DELTA( cvmGet( p->particles, 0, i ), 2, 0.0001 );
+        cvReleaseParticle( &p );
+    }
+
+    void testKld()
+    {
+        double binsizearr[] = { 1.0, 0 };
+        CvMat binsize = cvMat( 2, 1, CV_64FC1, binsizearr );
+        CvParticle* p = cvCreateParticle( 2, 5000, true );
+        cvParticleSetKld( p, 50, 0.05, 0.01, &binsize );
+        // concentrated posterior: all particles in one bin
+        for( int i = 0; i < p->num_particles; i++ )
+        {
+            cvmSet( p->particles, 0, i, 0.5 );
+            cvmSet( p->particles, 1, i, i );
+            cvmSet( p->weights, 0, i, 0 );
+        }
+        cvParticleResample( p );
+        TS_ASSERT_EQUALS( p->num_particles, 50 );
+        TS_ASSERT_EQUALS( p->particles->cols, 50 );
+        TS_ASSERT_EQUALS( p->weights->cols, 50 );
+        // spread posterior: many bins require more particles
+        for( int i = 0; i < p->num_particles; i++ )
+            cvmSet( p->particles, 0, i, i );
+        cvParticleResample( p );
+        TS_ASSERT_LESS_THAN( 50, p->num_particles );
+        TS_ASSERT_LESS_THAN_EQUALS( p->num_particles, 5000 );
+        cvParticleTransition( p );
+        TS_ASSERT_EQUALS( p->particles->cols, p->num_particles );
+        cvParticleInit( p );
+        TS_ASSERT_EQUALS( p->num_particles, 5000 );
+        cvReleaseParticle( &p );
+    }
+
+    void testCache()
+    {
+        double tolarr[] = { 0.5 };
+        CvMat tol = cvMat( 1, 1, CV_64FC1, tolarr );
+        CvParticle* p = cvCreateParticle( 1, 6 );
+        float states[] = { 1.0f, 2.0f, 1.1f, 1.0f, 3.0f, 2.0f };
+        for( int i = 0; i < 6; i++ )
+            cvmSet( p->particles, 0, i, states[i] );
+        // without cache, all particles are unique
+        TS_ASSERT_EQUALS( cvParticleFindDuplicates( p ), 6 );
+        cvParticleSetCache( p, &tol );
+        TS_ASSERT_EQUALS( cvParticleFindDuplicates( p ), 3 );
+        TS_ASSERT_EQUALS( p->duplicates->data.i[2], 0 );
+        TS_ASSERT_EQUALS( p->duplicates->data.i[3], 0 );
+        TS_ASSERT_EQUALS( p->duplicates->data.i[5], 1 );
+        for( int i = 0; i < 6; i++ )
+            if( p->duplicates->data.i[i] == i )
+                cvmSet( p->weights, 0, i, i + 1 );
+        cvParticleCopyDuplicates( p );
+        TS_ASSERT_DELTA( cvmGet( p->weights, 0, 3 ), 1, 0.0001 );
+        TS_ASSERT_DELTA( cvmGet( p->weights, 0, 5 ), 2, 0.0001 );
+        TS_ASSERT_EQUALS( p->cache_hits, 3 );
+        cvParticleSetCache( p, NULL );
+        TS_ASSERT_EQUALS( cvParticleFindDuplicates( p ), 6 );
+        cvReleaseParticle( &p );
+    }
+
+    void testTransitionStds()
+    {
+        // state 0 has no noise, state 1 has std 2
+        CvParticle* p = cvCreateParticle( 2, 4000 );
+        p->stds = cvCreateMat( 2, 4000, CV_32FC1 );
+        cvZero( p->particles );
+        for( int i = 0; i < 4000; i++ )
+        {
+            cvmSet( p->stds, 0, i, 0 );
+            cvmSet( p->stds, 1, i, 2 );
+        }
+        cvParticleTransition( p );
+        double sq = 0;
+        for( int i = 0; i < 4000; i++ )
+        {
+            TS_ASSERT_EQUALS( cvmGet( p->particles, 0, i ), 0 );
+            sq += cvmGet( p->particles, 1, i ) * cvmGet( p->particles, 1, i );
+        }
+        TS_ASSERT_DELTA( sqrt( sq / 4000 ), 2, 0.1 );
+        cvReleaseParticle( &p );
+    }
+
+    void testRandGaussArrDepth()
+    {
+        // sigma of another depth is converted, not read element by element
+        CvRNG rng = cvRNG( 1 );
+        CvMat* arr = cvCreateMat( 2, 4000, CV_32FC1 );
+        CvMat* buf = cvCreateMat( 2, 4000, CV_32FC1 );
+        CvMat* sigma = cvCreateMat( 2, 4000, CV_64FC1 );
+        for( int i = 0; i < 4000; i++ )
+        {
+            cvmSet( sigma, 0, i, 0 );
+            cvmSet( sigma, 1, i, 3 );
+        }
+        for( int k = 0; k < 2; k++ )
+        {
+            cvRandGaussArr( &rng, arr, sigma, k == 0 ? NULL : buf );
+            double sq = 0;
+            for( int i = 0; i < 4000; i++ )
+            {
+                TS_ASSERT_EQUALS( cvmGet( arr, 0, i ), 0 );
+                sq += cvmGet( arr, 1, i ) * cvmGet( arr, 1, i );
+            }
+            TS_ASSERT_DELTA( sqrt( sq / 4000 ), 3, 0.15 );
+        }
+        cvReleaseMat( &arr );
+        cvReleaseMat( &buf );
+        cvReleaseMat( &sigma );
+    }
+
+    void testCounterRng()
+    {
+        double boundarr[] = { 0, 10, 0, 0, 0, 0 };
+        CvMat bound = cvMat( 2, 3, CV_64FC1, boundarr );
+        CvParticle* p = cvCreateParticle( 2, 100 );
+        CvParticle* q = cvCreateParticle( 2, 100 );
+        cvParticleSetBound( p, &bound );
+        cvParticleSetBound( q, &bound );
+        cvParticleSetCounterRng( p, 12345 );
+        cvParticleSetCounterRng( q, 12345 );
+        q->rng = cvRNG( 999 ); // not used
+        cvParticleInit( p );
+        cvParticleInit( q );
+        cvParticleTransition( p );
+        cvParticleTransition( q );
+        for( int i = 0; i < 100; i++ )
+        {
+            TS_ASSERT_EQUALS( cvmGet( p->particles, 0, i ), cvmGet( q->particles, 0, i ) );
+            TS_ASSERT_EQUALS( cvmGet( p->particles, 1, i ), cvmGet( q->particles, 1, i ) );
+        }
+        TS_ASSERT( cvmGet( p->particles, 1, 0 ) != cvmGet( p->particles, 1, 1 ) );
+        // the next frame draws new noises
+        float prev = CV_MAT_ELEM( *p->noises, float, 1, 0 );
+        cvParticleTransition( p );
+        TS_ASSERT( CV_MAT_ELEM( *p->noises, float, 1, 0 ) != prev );
+        cvReleaseParticle( &p );
+        cvReleaseParticle( &q );
+    }
+
+    void testDynamicsKernels()
+    {
+        double identity[] = { 1,0,0,0, 0,1,0,0, 0,0,1,0, 0,0,0,1 };
+        double constvel[] = { 2,0,-1,0, 0,2,0,-1, 1,0,0,0, 0,1,0,0 };
+        double sparse[]   = { 1,0,0,0.5, 0,1,0,0, 0,0,1,0, 0,0,0,0.9 };
+        double dense[]    = { 1,2,3,4, 5,6,7,8, 9,1,2,3, 4,5,6,7 };
+        double* dynamics[] = { identity, constvel, sparse, dense };
+        int types[] = { CV_PARTICLE_DYNAMICS_IDENTITY, CV_PARTICLE_DYNAMICS_CONSTVEL,
+                        CV_PARTICLE_DYNAMICS_SPARSE, CV_PARTICLE_DYNAMICS_DENSE };
+        double stdarr[] = { 0, 0, 0, 0 };
+        CvMat std = cvMat( 4, 1, CV_64FC1, stdarr );
+        for( int d = 0; d < 4; d++ )
+        {
+            CvMat dyn = cvMat( 4, 4, CV_64FC1, dynamics[d] );
+            CvParticle* p = cvCreateParticle( 4, 10 );
+            CvMat* expected = cvCreateMat( 4, 10, CV_32FC1 );
+            cvParticleSetDynamics( p, &dyn );
+            cvParticleSetNoise( p, cvRNG( 1 ), &std );
+            TS_ASSERT_EQUALS( p->dynamics_type, types[d] );
+            for( int i = 0; i < 4; i++ )
+                for( int j = 0; j < 10; j++ )
+                    cvmSet( p->particles, i, j, i * 10 + j );
+            cvMatMul( p->dynamics, p->particles, expected );
+            cvParticleTransition( p );
+            for( int i = 0; i < 4; i++ )
+                for( int j = 0; j < 10; j++ )
+                    TS_ASSERT_DELTA( cvmGet( p->particles, i, j ), cvmGet( expected, i, j ), 0.001 );
+            cvReleaseMat( &expected );
+            cvReleaseParticle( &p );
+        }
+    }
+
+    void testDynamicsModifiedDirectly()
+    {
+        double stdarr[] = { 0, 0, 0, 0 };
+        CvMat std = cvMat( 4, 1, CV_64FC1, stdarr );
+        CvParticle* p = cvCreateParticle( 4, 10 );
+        CvMat* expected = cvCreateMat( 4, 10, CV_32FC1 );
+        cvParticleSetNoise( p, cvRNG( 1 ), &std );
+        // dense dynamics written without cvParticleSetDynamics
+        for( int i = 0; i < 4; i++ )
+            for( int j = 0; j < 4; j++ )
+                cvmSet( p->dynamics, i, j, i + j + 1 );
+        for( int i = 0; i < 4; i++ )
+            for( int j = 0; j < 10; j++ )
+                cvmSet( p->particles, i, j, i * 10 + j );
+        cvMatMul( p->dynamics, p->particles, expected );
+        cvParticleTransition( p );
+        TS_ASSERT_EQUALS( p->dynamics_type, CV_PARTICLE_DYNAMICS_DENSE );
+        for( int i = 0; i < 4; i++ )
+            for( int j = 0; j < 10; j++ )
+                TS_ASSERT_DELTA( cvmGet( p->particles, i, j ), cvmGet( expected, i, j ), 0.001 );
+        // back to identity
+        cvSetIdentity( p->dynamics );
+        cvCopy( p->particles, expected );
+        cvParticleTransition( p );
+        TS_ASSERT_EQUALS( p->dynamics_type, CV_PARTICLE_DYNAMICS_IDENTITY );
+        for( int i = 0; i < 4; i++ )
+            for( int j = 0; j < 10; j++ )
+                TS_ASSERT_DELTA( cvmGet( p->particles, i, j ), cvmGet( expected, i, j ), 0.001 );
+        cvReleaseMat( &expected );
+        cvReleaseParticle( &p );
+    }
+
+    void testTransitionT()
+    {
+        double constvel[] = { 2,0,-1,0, 0,2,0,-1, 1,0,0,0, 0,1,0,0 };
+        double dense[]    = { 1,0.2,0.3,0.4, 0.5,0.6,0.7,0.8, 0.9,0.1,0.2,0.3, 0.4,0.5,0.6,0.7 };
+        double* dynamics[] = { constvel, dense };
+        double stdarr[] = { 1, 2, 0.5, 0 };
+        double boundarr[] = { 0, 100, 0,  -50, 50, 1,  0, 0, 0,  0, 0, 0 };
+        CvMat std = cvMat( 4, 1, CV_64FC1, stdarr );
+        CvMat bound = cvMat( 4, 3, CV_64FC1, boundarr );
+        for( int d = 0; d < 2; d++ )
+        {
+            CvMat dyn = cvMat( 4, 4, CV_64FC1, dynamics[d] );
+            CvParticle* p = cvCreateParticle( 4, 300 );
+            CvParticle* q = cvCreateParticle( 4, 300 );
+            cvParticleSetDynamics( p, &dyn );
+            cvParticleSetDynamics( q, &dyn );
+            cvParticleSetNoise( p, cvRNG( 7 ), &std );
+            cvParticleSetNoise( q, cvRNG( 7 ), &std );
+            cvParticleSetBound( p, &bound );
+            cvParticleSetBound( q, &bound );
+            cvParticleSetBoundLinear( p, 2, 0, -1, 100 );
+            cvParticleSetBoundLinear( q, 2, 0, -1, 100 );
+            for( int i = 0; i < 4; i++ )
+                for( int j = 0; j < 300; j++ )
+                    cvmSet( p->particles, i, j, ( i * 37 + j * 11 ) % 100 - 25 );
+            cvCopy( p->particles, q->particles );
+            for( int t = 0; t < 3; t++ )
+            {
+                cvParticleTransition( p );
+                cvParticleTransitionT<4>( q );
+            }
+            TS_ASSERT( cvNorm( p->particles, NULL, CV_L1 ) > 0 );
+            for( int i = 0; i < 4; i++ )
+                for( int j = 0; j < 300; j++ )
+                    TS_ASSERT_DELTA( cvmGet( q->particles, i, j ), cvmGet( p->particles, i, j ), 0.001 );
+            cvReleaseParticle( &p );
+            cvReleaseParticle( &q );
+        }
+    }
+
+    void testGetSetStates()
+    {
+        CvParticle* p = cvCreateParticle( 3, 5 );
+        double in[] = { 1.5, -2, 30 };
+        double out[3];
+        cvZero( p->particles );
+        cvParticleSetStates<3>( p, 2, in );
+        TS_ASSERT_DELTA( cvmGet( p->particles, 1, 2 ), -2, 0.0001 );
+        TS_ASSERT_DELTA( cvmGet( p->particles, 1, 1 ), 0, 0.0001 );
+        cvParticleGetStates<3>( p, 2, out );
+        for( int i = 0; i < 3; i++ )
+            TS_ASSERT_DELTA( out[i], in[i], 0.0001 );
+        // the leading states only
+        out[2] = 0;
+        cvParticleGetStates<2>( p, 2, out );
+        TS_ASSERT_DELTA( out[1], -2, 0.0001 );
+        TS_ASSERT_EQUALS( out[2], 0 );
+        cvReleaseParticle( &p );
+    }
+
+    void testGetMean()
+    {
+        double w[] = { 0.1, 0.2, 0.3, 0.4 };
+        double meanarr[1];
+        CvMat mean = cvMat( 1, 1, CV_64FC1, meanarr );
+        for( int l = 0; l < 2; l++ )
+        {
+            CvParticle* p = createParticle( w, 4, l == 1 );
+            cvSet( p->ids, cvScalar( -1 ) );
+            cvParticleGetMean( p, &mean );
+            TS_ASSERT_DELTA( meanarr[0], 0.2 + 0.6 + 1.2, 0.0001 );
+            // top 2 particles (3 and 2)
+            cvParticleGetMean( p, &mean, 2 );
+            TS_ASSERT_DELTA( meanarr[0], ( 0.3 * 2 + 0.4 * 3 ) / 0.7, 0.0001 );
+            // MAP
+            cvParticleGetMean( p, &mean, 1 );
+            TS_ASSERT_DELTA( meanarr[0], 3, 0.0001 );
+            // survivor ids of resampling are not touched
+            for( int i = 0; i < 4; i++ )
+                TS_ASSERT_EQUALS( CV_MAT_ELEM( *p->ids, int, 0, i ), -1 );
+            cvReleaseParticle( &p );
+        }
+    }
+
+    void testGetMeanLogUnnormalized()
+    {
+        // log weights far below 0 are taken exp relative to the max
+        double meanarr[2];
+        CvMat mean = cvMat( 2, 1, CV_64FC1, meanarr );
+        CvParticle* p = cvCreateParticle( 2, 5, true );
+        for( int i = 0; i < 5; i++ )
+        {
+            cvmSet( p->particles, 0, i, i );
+            cvmSet( p->particles, 1, i, 10 * i );
+            cvmSet( p->weights, 0, i, -2000 + log( i + 1.0 ) );
+        }
+        cvParticleGetMean( p, &mean );
+        TS_ASSERT_DELTA( meanarr[0], ( 0 * 1 + 1 * 2 + 2 * 3 + 3 * 4 + 4 * 5 ) / 15.0, 1e-6 );
+        TS_ASSERT_DELTA( meanarr[1], 10 * meanarr[0], 1e-5 );
+        cvParticleGetMean( p, &mean, 2 ); // particles 4 and 3
+        TS_ASSERT_DELTA( meanarr[0], ( 3 * 4 + 4 * 5 ) / 9.0, 1e-6 );
+        TS_ASSERT_DELTA( meanarr[1], 10 * meanarr[0], 1e-5 );
+        cvReleaseParticle( &p );
+    }
+
+    void testGetMeanZeroWeights()
+    {
+        // linear weights summing to 0 give the plain average, not NaN
+        double w[] = { 0, 0, 0, 0 };
+        double meanarr[1];
+        CvMat mean = cvMat( 1, 1, CV_64FC1, meanarr );
+        CvParticle* p = createParticle( w, 4 );
+        cvParticleGetMean( p, &mean );
+        TS_ASSERT_DELTA( meanarr[0], 1.5, 0.0001 );
+        cvParticleGetMean( p, &mean, 2 );
+        TS_ASSERT( meanarr[0] == meanarr[0] );
+        cvReleaseParticle( &p );
+    }
+
+    void testGetMeanCircular()
+    {
+        double boundarr[] = { 0, 360, 1 };
+        CvMat bound = cvMat( 1, 3, CV_64FC1, boundarr );
+        double meanarr[1];
+        CvMat mean = cvMat( 1, 1, CV_64FC1, meanarr );
+        CvParticle* p = cvCreateParticle( 1, 2 );
+        cvParticleSetBound( p, &bound );
+        cvmSet( p->particles, 0, 0, 358 );
+        cvmSet( p->particles, 0, 1, 4 );
+        cvmSet( p->weights, 0, 0, 0.5 );
+        cvmSet( p->weights, 0, 1, 0.5 );
+        cvParticleGetMean( p, &mean );
+        TS_ASSERT_DELTA( meanarr[0], 1, 0.001 );
+        cvmSet( p->particles, 0, 1, 354 );
+        cvParticleGetMean( p, &mean );
+        TS_ASSERT_DELTA( meanarr[0], 356, 0.001 );
+        cvReleaseParticle( &p );
+    }
+
+    void testCascadeSelect()
+    {
+        double scores[] = { 5, -1, 3, 9, 7, 0 };
+        int order[6];
+        // top half
+        TS_ASSERT_EQUALS( cvParticleCascadeSelect( scores, 6, 0.5, -DBL_MAX, order ), 3 );
+        int selected = 0;
+        for( int i = 0; i < 3; i++ )
+            selected |= 1 << order[i];
+        TS_ASSERT_EQUALS( selected, ( 1 << 0 ) | ( 1 << 3 ) | ( 1 << 4 ) );
+        // threshold rejects before the ratio
+        TS_ASSERT_EQUALS( cvParticleCascadeSelect( scores, 6, 1, 6, order ), 2 );
+        TS_ASSERT_EQUALS( cvParticleCascadeSelect( scores, 6, 1, 10, order ), 0 );
+    }
+
+    void testSnapshot()
+    {
+        double dynarr[] = { 1, 1, 0, 1 };
+        double stdarr[] = { 1, 0.5 };
+        double boundarr[] = { 0, 100, 0, 0, 360, 1 };
+        double binarr[] = { 1, 1 };
+        CvMat dynamics = cvMat( 2, 2, CV_64FC1, dynarr );
+        CvMat std = cvMat( 2, 1, CV_64FC1, stdarr );
+        CvMat bound = cvMat( 2, 3, CV_64FC1, boundarr );
+        CvMat binsize = cvMat( 2, 1, CV_64FC1, binarr );
+        CvParticle* p = cvCreateParticle( 2, 200, true );
+        cvParticleSetDynamics( p, &dynamics );
+        cvParticleSetNoise( p, cvRNG( 7 ), &std );
+        cvParticleSetBound( p, &bound );
+        cvParticleSetResample( p, CV_PARTICLE_RESAMPLE_SYSTEMATIC );
+        cvParticleSetKld( p, 20, 0.05, 0.01, &binsize );
+        cvParticleInit( p );
+        for( int i = 0; i < p->num_particles; i++ )
+            cvmSet( p->weights, 0, i, -0.01 * i );
+        cvParticleNormalize( p );
+        cvParticleResample( p );
+        cvSaveParticle( "cvparticle_snapshot.bin", p );
+        CvParticle* q = cvLoadParticle( "cvparticle_snapshot.bin" );
+        // truncated and corrupted snapshots are not loaded
+        {
+            FILE* fp = fopen( "cvparticle_snapshot.bin", "rb" );
+            long size;
+            char* buf;
+            fseek( fp, 0, SEEK_END );
+            size = ftell( fp );
+            fseek( fp, 0, SEEK_SET );
+            buf = (char*)malloc( size );
+            TS_ASSERT_EQUALS( fread( buf, 1, size, fp ), (size_t)size );
+            fclose( fp );
+            fp = fopen( "cvparticle_snapshot.bin", "wb" );
+            fwrite( buf, 1, size - 8, fp );
+            fclose( fp );
+            TS_ASSERT( cvLoadParticle( "cvparticle_snapshot.bin" ) == NULL );
+            ((CvParticleSnapshotHeader*)buf)->num_particles = 1 << 30;
+            fp = fopen( "cvparticle_snapshot.bin", "wb" );
+            fwrite( buf, 1, size, fp );
+            fclose( fp );
+            TS_ASSERT( cvLoadParticle( "cvparticle_snapshot.bin" ) == NULL );
+            free( buf );
+        }
+        remove( "cvparticle_snapshot.bin" );
+        TS_ASSERT( q != NULL );
+        TS_ASSERT_EQUALS( q->num_particles, p->num_particles );
+        TS_ASSERT_EQUALS( q->max_particles, 200 );
+        TS_ASSERT_EQUALS( q->dynamics_type, p->dynamics_type );
+        TS_ASSERT_EQUALS( q->resample, p->resample );
+        TS_ASSERT_DELTA( q->kld_z, p->kld_z, 1e-12 );
+        // continues exactly the same
+        cvParticleTransition( p );
+        cvParticleTransition( q );
+        for( int i = 0; i < p->num_particles; i++ )
+            for( int s = 0; s < 2; s++ )
+                TS_ASSERT_EQUALS( cvmGet( p->particles, s, i ), cvmGet( q->particles, s, i ) );
+        cvReleaseParticle( &p );
+        cvReleaseParticle( &q );
+        TS_ASSERT( cvLoadParticle( "cvparticle_no_such_file.bin" ) == NULL );
+    }
+
+    void testBound()
+    {
+        // x in [0, 100], width in [1, 100] and width <= 100 - x, angle wraps
+        double boundarr[] = { 0, 100, 0, 1, 100, 0, 0, 360, 1 };
+        CvMat bound = cvMat( 3, 3, CV_64FC1, boundarr );
+        CvParticle* p = cvCreateParticle( 3, 600 );
+        cvParticleSetBound( p, &bound );
+        cvParticleSetBoundLinear( p, 1, 0, -1, 100 );
+        for( int i = 0; i < 600; i++ )
+        {
+            cvmSet( p->particles, 0, i, i % 3 == 0 ? -5 : 90 );
+            cvmSet( p->particles, 1, i, i % 2 == 0 ? 50 : 0 );
+            cvmSet( p->particles, 2, i, i % 2 == 0 ? -10 : 370 );
+        }
+        cvParticleBound( p );
+        for( int i = 0; i < 600; i++ )
+        {
+            double x = i % 3 == 0 ? 0 : 90;
+            TS_ASSERT_DELTA( cvmGet( p->particles, 0, i ), x, 0.0001 );
+            TS_ASSERT_DELTA( cvmGet( p->particles, 1, i ), i % 2 == 0 ? MIN( 50, 100 - x ) : 1, 0.0001 );
+            TS_ASSERT_DELTA( cvmGet( p->particles, 2, i ), i % 2 == 0 ? 350 : 10, 0.0001 );
+        }
+        cvReleaseParticle( &p );
+    }
+
+    void testProfile()
+    {
+        CvParticle* p = cvCreateParticle( 1, 100 );
+        TS_ASSERT( p->profile == NULL );
+        cvParticleSetProfile( p );
+        cvParticleSetResample( p, CV_PARTICLE_RESAMPLE_SYSTEMATIC );
+        cvParticleInit( p );
+        cvParticleTransition( p );
+        // only the first 10 particles have weights
+        for( int i = 0; i < 100; i++ )
+            cvmSet( p->weights, 0, i, i < 10 ? 1 : 0 );
+        cvParticleNormalize( p );
+        cvParticleResample( p );
+        TS_ASSERT_EQUALS( p->profile->calls[CV_PARTICLE_PROFILE_TRANSITION], 1 );
+        TS_ASSERT_EQUALS( p->profile->calls[CV_PARTICLE_PROFILE_BOUND], 1 );
+        TS_ASSERT_EQUALS( p->profile->calls[CV_PARTICLE_PROFILE_OBSERVE], 0 );
+        TS_ASSERT_EQUALS( p->profile->calls[CV_PARTICLE_PROFILE_NORMALIZE], 1 );
+        TS_ASSERT_EQUALS( p->profile->calls[CV_PARTICLE_PROFILE_RESAMPLE], 1 );
+        TS_ASSERT_DELTA( p->profile->ess, 10, 1e-9 );
+        TS_ASSERT_EQUALS( p->profile->unique, 10 );
+        TS_ASSERT( cvParticleProfileMsec( p, CV_PARTICLE_PROFILE_TRANSITION ) >= 0 );
+        TS_ASSERT_EQUALS( cvParticleProfileMsec( p, CV_PARTICLE_PROFILE_OBSERVE ), 0 );
+        cvParticleSetProfile( p ); // reset
+        TS_ASSERT_EQUALS( p->profile->calls[CV_PARTICLE_PROFILE_RESAMPLE], 0 );
+        cvParticleSetProfile( p, false );
+        TS_ASSERT( p->profile == NULL );
+        cvParticleResample( p );
+        cvReleaseParticle( &p );
+    }
+
+    void testObserveIntegral()
+    {
+        CvRNG rng = cvRNG( 1 );
+        IplImage* frame = cvCreateImage( cvSize( 20, 15 ), IPL_DEPTH_8U, 3 );
+        CvParticleObserveIntegral* ctx = cvCreateParticleObserveIntegral( 2, 10.0 );
+        CvRect rect = cvRect( 3, 2, 9, 7 ), cell;
+        double desc[( 2 * 2 + 1 ) * 3];
+        int gx, gy, ch, x, y, d = 0;
+        cvRandArr( &rng, frame, CV_RAND_UNI, cvScalarAll( 0 ), cvScalarAll( 256 ) );
+        cvParticleObserveIntegralUpdate( ctx, frame );
+        TS_ASSERT_EQUALS( icvRectDescriptor( ctx, rect, desc, NULL ), 0 );
+
+        // brute force. cells split as [3, 7) [7, 12) x [2, 5) [5, 9)
+        for( gy = 0; gy < 2; gy++ ) {
+            for( gx = 0; gx < 2; gx++ ) {
+                cell.x = gx == 0 ? 3 : 7; cell.width = gx == 0 ? 4 : 5;
+                cell.y = gy == 0 ? 2 : 5; cell.height = gy == 0 ? 3 : 4;
+                for( ch = 0; ch < 3; ch++, d++ ) {
+                    double sum = 0;
+                    for( y = cell.y; y < cell.y + cell.height; y++ )
+                        for( x = cell.x; x < cell.x + cell.width; x++ )
+                            sum += CV_IMAGE_ELEM( frame, uchar, y, x * 3 + ch );
+                    TS_ASSERT_DELTA( desc[d], sum / ( cell.width * cell.height ), 1e-6 );
+                }
+            }
+        }
+        for( ch = 0; ch < 3; ch++, d++ ) {
+            double sum = 0, sq = 0, n = rect.width * rect.height, val;
+            for( y = rect.y; y < rect.y + rect.height; y++ ) {
+                for( x = rect.x; x < rect.x + rect.width; x++ ) {
+                    val = CV_IMAGE_ELEM( frame, uchar, y, x * 3 + ch );
+                    sum += val;
+                    sq += val * val;
+                }
+            }
+            TS_ASSERT_DELTA( desc[d], sqrt( sq / n - ( sum / n ) * ( sum / n ) ), 1e-6 );
+        }
+
+        // distance to itself and outside of the frame
+        cvParticleObserveIntegralSetReference( ctx, rect );
+        TS_ASSERT_DELTA( icvRectDescriptor( ctx, rect, NULL, ctx->reference->data.db ), 0, 1e-9 );
+        TS_ASSERT_EQUALS( icvRectDescriptor( ctx, cvRect( 30, 30, 5, 5 ), NULL, NULL ), -1 );
+
+        // weights of the reference, a shifted and an outside particle
+        for( int logweight = 0; logweight < 2; logweight++ )
+        {
+            CvParticle* p = cvCreateParticle( num_states, 3, logweight != 0 );
+            cvParticleStateSet( p, 0, cvParticleState( 7.5, 5.5, 9, 7, 0 ) );
+            cvParticleStateSet( p, 1, cvParticleState( 8.5, 6.5, 9, 7, 0 ) );
+            cvParticleStateSet( p, 2, cvParticleState( 40, 40, 9, 7, 0 ) );
+            rect = cvRectFromBox32f( cvBox32f( 7.5, 5.5, 9, 7, 0 ) );
+            cvParticleObserveIntegralSetReference( ctx, rect );
+            double dist = icvRectDescriptor( ctx, cvRectFromBox32f( cvBox32f( 8.5, 6.5, 9, 7, 0 ) ), 
+                                             NULL, ctx->reference->data.db );
+            cvParticleObserveMeasure( p, ctx );
+            if( logweight )
+            {
+                TS_ASSERT_DELTA( cvmGet( p->weights, 0, 0 ), 0, 1e-9 );
+                TS_ASSERT_DELTA( cvmGet( p->weights, 0, 1 ), -dist / 200.0, 1e-9 );
+                TS_ASSERT_EQUALS( cvmGet( p->weights, 0, 2 ), -DBL_MAX );
+            }
+            else
+            {
+                TS_ASSERT_DELTA( cvmGet( p->weights, 0, 0 ), 1, 1e-9 );
+                TS_ASSERT_DELTA( cvmGet( p->weights, 0, 1 ), exp( -dist / 200.0 ), 1e-9 );
+                TS_ASSERT_EQUALS( cvmGet( p->weights, 0, 2 ), 0 );
+            }
+            cvReleaseParticle( &p );
+        }
+        cvReleaseParticleObserveIntegral( &ctx );
+        cvReleaseImage( &frame );
+    }
+
+    void testCropResizeNormL2()
+    {
+        // a smooth image and rectangles inside of it, so that the differences 
+        // from cvCropImageROI + cvResize (rounding of the patch, clamping at 
+        // its border) are small. tolerance: 1.5 gray levels in RMS per element
+        CvRNG rng = cvRNG( 1 );
+        IplImage* img = cvCreateImage( cvSize( 80, 60 ), IPL_DEPTH_8U, 3 );
+        IplImage* reference = cvCreateImage( cvSize( 24, 24 ), IPL_DEPTH_8U, 3 );
+        IplImage* resize = cvCreateImage( cvSize( 24, 24 ), IPL_DEPTH_8U, 3 );
+        CvRect32f rects[] = { cvRect32f( 20, 15, 30, 20, 0 ), cvRect32f( 10, 5, 12, 12, 0 ),
+                              cvRect32f( 30, 30, 30, 20, 30 ), cvRect32f( 35, 10, 25, 20, -45 ) };
+        double tol = 1.5 * sqrt( 24.0 * 24 * 3 );
+        for( int y = 0; y < img->height; y++ )
+            for( int x = 0; x < img->width; x++ )
+                for( int ch = 0; ch < 3; ch++ )
+                    CV_IMAGE_ELEM( img, uchar, y, x * 3 + ch ) = 
+                        (uchar)cvRound( 100 + 50 * sin( x / 7.0 ) + 40 * cos( y / 5.0 ) + 10 * ch );
+        for( int r = 0; r < 4; r++ )
+        {
+            CvRect rect = cvRectFromRect32f( rects[r] );
+            IplImage* crop = cvCreateImage( cvSize( rect.width, rect.height ), IPL_DEPTH_8U, 3 );
+            cvCropImageROI( img, crop, rects[r] );
+            cvResize( crop, resize );
+            TS_ASSERT( icvCropResizeNormL2( img, resize, rects[r] ) <= tol );
+            cvRandArr( &rng, reference, CV_RAND_UNI, cvScalarAll( 0 ), cvScalarAll( 256 ) );
+            TS_ASSERT_DELTA( icvCropResizeNormL2( img, reference, rects[r] ), 
+                             cvNorm( resize, reference, CV_L2 ), tol );
+            cvReleaseImage( &crop );
+        }
+        cvReleaseImage( &img );
+        cvReleaseImage( &reference );
+        cvReleaseImage( &resize );
+    }
+};
@@ -0,0 +1,270 @@
+/**
+ * Throughput benchmark of particle filter tracking
+ *
+ * Tracks a moving rectangle on synthetic frames and prints one CSV row
+ * per configuration (num_particles x logweight) to stdout.
+ * The state model and the observation model are chosen at compilation
+ * because they define the same symbols.
+ *
+ * g++ -O2 -DBENCH_STATE=1 -DBENCH_OBSERVE=1 cvparticlebench.cpp ...
+ * (make bench builds all 4 combinations)
+ *
+ * Columns
+ *   state, observe, num_states, num_particles, logweight, frames,
+ *   fps, ns_per_particle, allocs_per_frame,
+ *   transition_ms, observe_ms, normalize_ms, resample_ms (per frame)
+ *
+ * Usage: cvparticlebench [--no-header] [num_particles ...]
+ */
+#ifdef _MSC_VER
+#pragma warning(disable:4996)
+#pragma comment(lib, "cv.lib")
+#pragma comment(lib, "cxcore.lib")
+#pragma comment(lib, "cvaux.lib")
+#pragma comment(lib, "highgui.lib")
+#endif
+
+#ifndef BENCH_STATE
+#define BENCH_STATE 1
+#endif
+#ifndef BENCH_OBSERVE
+#define BENCH_OBSERVE 1
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cv.h"
+#include "cvaux.h"
+#include "cxcore.h"
+#include "cvparticle.h"
+#if BENCH_STATE == 1
+#include "cvparticle/state1.h"
+#else
+#include "cvparticle/state2.h"
+#endif
+#if BENCH_OBSERVE == 1
+#include "cvparticle/observe1.h"
+#else
+#include "cvparticle/observe2.h"
+#endif
+
+#define BENCH_WIDTH   320
+#define BENCH_HEIGHT  240
+#define BENCH_TARGET  40     /**< side of the target rectangle */
+#define BENCH_FEATURE 24     /**< side of image patches of the observation models */
+#define BENCH_WARMUP  2      /**< frames not measured */
+#define BENCH_WORK    200000 /**< num_particles * frames measured */
+
+/************************** Allocation counter ******************************/
+
+int bench_allocs = 0; /**< number of cvAlloc calls */
+
+void* CV_CDECL benchAlloc( size_t size, void* userdata )
+{
+    bench_allocs++;
+    return malloc( size );
+}
+
+int CV_CDECL benchFree( void* ptr, void* userdata )
+{
+    free( ptr );
+    return CV_OK;
+}
+
+/************************** Synthetic frames ********************************/
+
+/**
+ * Center of the target at frame t. Moves along a Lissajous curve
+ */
+CvPoint benchTarget( int t )
+{
+    return cvPoint( cvRound( BENCH_WIDTH / 2 + 100 * sin( t * 0.05 ) ),
+                    cvRound( BENCH_HEIGHT / 2 + 60 * sin( t * 0.07 ) ) );
+}
+
+/**
+ * Draw frame t: a bright rectangle on fixed noise
+ */
+void benchFrame( IplImage* frame, const IplImage* background, int t )
+{
+    CvPoint c = benchTarget( t );
+    cvCopy( background, frame );
+    cvRectangle( frame, cvPoint( c.x - BENCH_TARGET / 2, c.y - BENCH_TARGET / 2 ),
+                 cvPoint( c.x + BENCH_TARGET / 2, c.y + BENCH_TARGET / 2 ),
+                 CV_RGB( 255, 200, 0 ), CV_FILLED );
+}
+
+/*************************** Observation models *****************************/
+
+#if BENCH_OBSERVE == 1
+typedef IplImage BenchModel;
+
+BenchModel* benchCreateModel( const IplImage* frame )
+{
+    CvPoint c = benchTarget( 0 );
+    IplImage* reference = cvCreateImage( cvSize( BENCH_FEATURE, BENCH_FEATURE ), frame->depth, frame->nChannels );
+    cvSetImageROI( (IplImage*)frame, cvRect( c.x - BENCH_TARGET / 2, c.y - BENCH_TARGET / 2,
+                                             BENCH_TARGET, BENCH_TARGET ) );
+    cvResize( frame, reference );
+    cvResetImageROI( (IplImage*)frame );
+    return reference;
+}
+
+void benchReleaseModel( BenchModel** model )
+{
+    cvReleaseImage( model );
+}
+
+void benchMeasure( CvParticle* p, IplImage* frame, BenchModel* model )
+{
+    cvParticleObserveMeasure( p, frame, model );
+}
+#else
+typedef struct BenchModel {
+    CvPcaDiffsModel* pca;
+    CvParticleObservePca* ctx;
+} BenchModel;
+
+/**
+ * A synthetic PCA subspace: the mean is a random patch and the
+ * eigen vectors are the first M axes
+ */
+BenchModel* benchCreateModel( const IplImage* frame )
+{
+    int D = BENCH_FEATURE * BENCH_FEATURE, M = 10, nEig = 20, i;
+    CvRNG rng = cvRNG( 1 );
+    CvMat* avg = cvCreateMat( D, 1, CV_32FC1 );
+    CvMat* eigenvalues = cvCreateMat( nEig, 1, CV_32FC1 );
+    CvMat* eigenvectors = cvCreateMat( M, D, CV_32FC1 );
+    BenchModel* model = (BenchModel*)cvAlloc( sizeof( BenchModel ) );
+    cvRandArr( &rng, avg, CV_RAND_NORMAL, cvScalar( 0 ), cvScalar( 1.0 / sqrt( (double)D ) ) );
+    for( i = 0; i < nEig; i++ )
+        cvmSet( eigenvalues, i, 0, 1.0 / ( i + 1 ) );
+    cvSetIdentity( eigenvectors );
+    model->pca = cvCreatePcaDiffsModel( avg, eigenvalues, eigenvectors );
+    model->ctx = cvCreateParticleObservePca( cvSize( BENCH_FEATURE, BENCH_FEATURE ), model->pca );
+    cvReleaseMat( &avg );
+    cvReleaseMat( &eigenvalues );
+    cvReleaseMat( &eigenvectors );
+    return model;
+}
+
+void benchReleaseModel( BenchModel** model )
+{
+    cvReleaseParticleObservePca( &(*model)->ctx );
+    cvReleasePcaDiffsModel( &(*model)->pca );
+    cvFree( model );
+}
+
+void benchMeasure( CvParticle* p, IplImage* frame, BenchModel* model )
+{
+    cvParticleObserveMeasure( p, frame, model->ctx );
+}
+#endif
+
+/******************************** Benchmark *********************************/
+
+/**
+ * Track BENCH_WARMUP + frames frames and print a CSV row
+ */
+void benchRun( int num_particles, bool logweight, const IplImage* background )
+{
+    int frames = MIN( 100, MAX( 3, BENCH_WORK / num_particles ) );
+    int t, i, allocs;
+    int64 start = 0, ticks;
+    double msec;
+    IplImage* frame = cvCloneImage( background );
+    CvPoint c = benchTarget( 0 );
+    CvParticleState std = cvParticleState( 3.0, 3.0, 1.0, 1.0, 1.0 );
+    CvParticleState s = cvParticleState( c.x, c.y, BENCH_TARGET, BENCH_TARGET, 0 );
+    CvParticle* init = cvCreateParticle( num_states, 1 );
+    CvParticle* p = cvCreateParticle( num_states, num_particles, logweight );
+    BenchModel* model;
+
+    benchFrame( frame, background, 0 );
+    model = benchCreateModel( frame );
+    cvParticleStateConfig( p, cvGetSize( frame ), std );
+    p->rng = cvRNG( 1 ); // reproducible. cvParticleStateConfig seeds by time
+    cvParticleStateSet( init, 0, s );
+    cvParticleInit( p, init );
+
+    for( t = 0; t < BENCH_WARMUP + frames; t++ )
+    {
+        if( t == BENCH_WARMUP )
+        {
+            cvParticleSetProfile( p );
+            bench_allocs = 0;
+            start = cvGetTickCount();
+        }
+        benchFrame( frame, background, t );
+        cvParticleTransitionT<num_states>( p );
+        benchMeasure( p, frame, model );
+        if( !logweight ) // likelihoods relative to the best
+        {
+            double maxval;
+            cvMinMaxLoc( p->weights, NULL, &maxval );
+            for( i = 0; i < p->num_particles; i++ )
+                p->weights->data.db[i] = exp( p->weights->data.db[i] - maxval );
+        }
+        cvParticleNormalize( p );
+        cvParticleResample( p );
+    }
+    ticks = cvGetTickCount() - start;
+    allocs = bench_allocs;
+
+    msec = ticks / ( cvGetTickFrequency() * 1000 );
+    printf( "state%d,observe%d,%d,%d,%d,%d,%.2f,%.2f,%.2f,%.4f,%.4f,%.4f,%.4f\n",
+            BENCH_STATE, BENCH_OBSERVE, num_states, num_particles, (int)logweight, frames,
+            frames / ( msec / 1000 ), msec * 1e6 / ( (double)frames * num_particles ),
+            (double)allocs / frames,
+            cvParticleProfileMsec( p, CV_PARTICLE_PROFILE_TRANSITION ),
+            cvParticleProfileMsec( p, CV_PARTICLE_PROFILE_OBSERVE ),
+            cvParticleProfileMsec( p, CV_PARTICLE_PROFILE_NORMALIZE ),
+            cvParticleProfileMsec( p, CV_PARTICLE_PROFILE_RESAMPLE ) );
+    fflush( stdout );
+
+    benchReleaseModel( &model );
+    cvReleaseParticle( &init );
+    cvReleaseParticle( &p );
+    cvReleaseImage( &frame );
+}
+
+int main( int argc, char** argv )
+{
+    int sizes[16] = { 100, 1000, 10000, 100000 };
+    int num_sizes = 4, i, l;
+    bool header = true;
+    int args[16], num_args = 0;
+    CvRNG rng = cvRNG( 1 );
+    IplImage* background;
+
+    // installed for the whole run so that every block is freed by its allocator
+    cvSetMemoryManager( benchAlloc, benchFree, NULL );
+    background = cvCreateImage( cvSize( BENCH_WIDTH, BENCH_HEIGHT ), IPL_DEPTH_8U, 3 );
+
+    for( i = 1; i < argc; i++ )
+    {
+        if( strcmp( argv[i], "--no-header" ) == 0 )
+            header = false;
+        else if( atoi( argv[i] ) > 0 && num_args < 16 )
+            args[num_args++] = atoi( argv[i] );
+    }
+    if( num_args > 0 ) // replace the default sweep
+    {
+        memcpy( sizes, args, num_args * sizeof( int ) );
+        num_sizes = num_args;
+    }
+    cvRandArr( &rng, background, CV_RAND_UNI, cvScalarAll( 0 ), cvScalarAll( 256 ) );
+
+    if( header )
+        printf( "state,observe,num_states,num_particles,logweight,frames,"
+                "fps,ns_per_particle,allocs_per_frame,"
+                "transition_ms,observe_ms,normalize_ms,resample_ms\n" );
+    for( i = 0; i < num_sizes; i++ )
+        for( l = 0; l < 2; l++ )
+            benchRun( sizes[i], l == 1, background );
+
+    cvReleaseImage( &background );
+    return 0;
+}
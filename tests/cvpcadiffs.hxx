@@ -50,4 +50,75 @@ public:
         TS_ASSERT_DELTA( cvmGet( loglikeli, 0, 1 ), -2.7749, 0.001 );
     }
 
+    void testPcaDiffsModel()
+    {
+        int D = 4, N = 3;
+        double s = sqrt( 0.5 );
+        double vec[] = {
+            s, s, 0, 0,
+            0, 0, s, -s
+        }; // M x D
+        double val[] = { 2.0, 0.5, 0.1, 0.05 };
+        double avg[] = { 0.1, 0.2, 0.3, 0.4 };
+        double x[] = {
+            0.4854,    0.9157,    0.0357,
+            0.8003,    0.7922,    0.8491,
+            0.1419,    0.9595,    0.9340,
+            0.4218,    0.6557,    0.6787
+        };
+        CvMat eigenvectors = cvMat( 2, D, CV_64FC1, vec );
+        CvMat eigenvalues = cvMat( 4, 1, CV_64FC1, val );
+        CvMat avgmat = cvMat( D, 1, CV_64FC1, avg );
+        CvMat samples = cvMat( D, N, CV_64FC1, x );
+        CvMat *samplesT = cvCreateMat( N, D, CV_32FC1 );
+        CvMat *expected = cvCreateMat( 1, N, CV_64FC1 );
+        CvMat *probs = cvCreateMat( 1, N, CV_64FC1 );
+        for( int normalize = 0; normalize <= 2; normalize++ )
+        {
+            CvPcaDiffsModel* model = cvCreatePcaDiffsModel( &avgmat, &eigenvalues, &eigenvectors, normalize );
+            cvMatPcaDiffs( &samples, &avgmat, &eigenvalues, &eigenvectors, expected, normalize, true );
+            cvT( &samples, samplesT );
+            cvPcaDiffsModelProbs( model, samplesT, probs, true );
+            for( int n = 0; n < N; n++ )
+                TS_ASSERT_DELTA( cvmGet( probs, 0, n ), cvmGet( expected, 0, n ), 0.0001 );
+            cvReleasePcaDiffsModel( &model );
+        }
+        cvReleaseMat( &samplesT );
+        cvReleaseMat( &expected );
+        cvReleaseMat( &probs );
+    }
+
+    void testPcaDiffsMixedDepth()
+    {
+        int D = 4, N = 3;
+        float s = (float)sqrt( 0.5 );
+        float vec[] = {
+            s, s, 0, 0,
+            0, 0, s, -s
+        }; // M x D
+        float val[] = { 2.0f, 0.5f, 0.1f, 0.05f };
+        float avg32[] = { 0.1f, 0.2f, 0.3f, 0.4f };
+        double avg64[] = { 0.1, 0.2, 0.3, 0.4 };
+        float x[] = {
+            0.4854f,    0.9157f,    0.0357f,
+            0.8003f,    0.7922f,    0.8491f,
+            0.1419f,    0.9595f,    0.9340f,
+            0.4218f,    0.6557f,    0.6787f
+        };
+        CvMat eigenvectors = cvMat( 2, D, CV_32FC1, vec );
+        CvMat eigenvalues = cvMat( 4, 1, CV_32FC1, val );
+        CvMat avgmat32 = cvMat( D, 1, CV_32FC1, avg32 );
+        CvMat avgmat64 = cvMat( D, 1, CV_64FC1, avg64 );
+        CvMat samples = cvMat( D, N, CV_32FC1, x );
+        CvMat *expected = cvCreateMat( 1, N, CV_64FC1 );
+        CvMat *probs = cvCreateMat( 1, N, CV_64FC1 );
+        // 64F mean with 32F samples
+        cvMatPcaDiffs( &samples, &avgmat32, &eigenvalues, &eigenvectors, expected, 1, true );
+        cvMatPcaDiffs( &samples, &avgmat64, &eigenvalues, &eigenvectors, probs, 1, true );
+        for( int n = 0; n < N; n++ )
+            TS_ASSERT_DELTA( cvmGet( probs, 0, n ), cvmGet( expected, 0, n ), 0.0001 );
+        cvReleaseMat( &expected );
+        cvReleaseMat( &probs );
+    }
+
 };
@@ -0,0 +1,120 @@
+#ifdef _MSC_VER
+#pragma warning(disable:4996)
+#pragma comment(lib, "cv.lib")
+#pragma comment(lib, "cxcore.lib")
+#pragma comment(lib, "cvaux.lib")
+#pragma comment(lib, "highgui.lib")
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "cv.h"
+#include "cvaux.h"
+#include "cxcore.h"
+#include "cvpipeline.h"
+#include <chrono>
+
+#include <cxxtest/TestSuite.h>
+
+// stages sleep so that they overlap
+struct PipelineTestData {
+    int num_frames;   // capture returns false after this
+    int stop_at;      // render returns false at this frame. -1 for never
+    int captured;
+    int rendered;
+    int out_of_order;
+};
+
+static bool pipelineCapture( CvPipelineFrame* f, void* userdata )
+{
+    PipelineTestData* d = (PipelineTestData*)userdata;
+    if( f->index >= d->num_frames ) return false;
+    std::this_thread::sleep_for( std::chrono::milliseconds( 2 ) );
+    d->captured++;
+    return true;
+}
+
+static bool pipelineTrack( CvPipelineFrame* f, void* userdata )
+{
+    std::this_thread::sleep_for( std::chrono::milliseconds( 2 ) );
+    *(int*)f->result = f->index * 10;
+    return true;
+}
+
+static bool pipelineRender( CvPipelineFrame* f, void* userdata );
+
+// track stops at the frame stop_at
+static bool pipelineTrackStop( CvPipelineFrame* f, void* userdata )
+{
+    PipelineTestData* d = (PipelineTestData*)userdata;
+    pipelineTrack( f, userdata );
+    return f->index != d->stop_at;
+}
+
+static bool pipelineRenderAll( CvPipelineFrame* f, void* userdata )
+{
+    pipelineRender( f, userdata );
+    return true;
+}
+
+static bool pipelineRender( CvPipelineFrame* f, void* userdata )
+{
+    PipelineTestData* d = (PipelineTestData*)userdata;
+    std::this_thread::sleep_for( std::chrono::milliseconds( 2 ) );
+    if( f->index != d->rendered || *(int*)f->result != f->index * 10 )
+        d->out_of_order++;
+    d->rendered++;
+    return f->index != d->stop_at;
+}
+
+class CvPipelineTest : public CxxTest::TestSuite
+{
+public:
+    void testRunPipeline()
+    {
+        PipelineTestData d = { 30, -1, 0, 0, 0 };
+        CvPipelineStats stats = cvRunPipeline( pipelineCapture, pipelineTrack, pipelineRender,
+                                               &d, 3, sizeof( int ) );
+        TS_ASSERT_EQUALS( stats.frames, 30 );
+        TS_ASSERT_EQUALS( d.captured, 30 );
+        TS_ASSERT_EQUALS( d.rendered, 30 );
+        TS_ASSERT_EQUALS( d.out_of_order, 0 );
+        TS_ASSERT( stats.fps > 0 );
+        TS_ASSERT( stats.latency_ms <= stats.max_latency_ms );
+    }
+
+    void testRunPipelineOneBuffer()
+    {
+        PipelineTestData d = { 5, -1, 0, 0, 0 };
+        CvPipelineStats stats = cvRunPipeline( pipelineCapture, pipelineTrack, pipelineRender,
+                                               &d, 1, sizeof( int ) );
+        TS_ASSERT_EQUALS( stats.frames, 5 );
+        TS_ASSERT_EQUALS( d.out_of_order, 0 );
+    }
+
+    void testRunPipelineStop()
+    {
+        // render stops at the frame 5. frames in flight are discarded
+        PipelineTestData d = { 1000, 5, 0, 0, 0 };
+        CvPipelineStats stats = cvRunPipeline( pipelineCapture, pipelineTrack, pipelineRender,
+                                               &d, 3, sizeof( int ) );
+        TS_ASSERT_EQUALS( stats.frames, 6 );
+        TS_ASSERT_EQUALS( d.rendered, 6 );
+        TS_ASSERT_EQUALS( d.out_of_order, 0 );
+        TS_ASSERT( d.captured < 1000 );
+    }
+
+    void testRunPipelineTrackStop()
+    {
+        // frames 0 to 4 are rendered. frame 5 and later are recycled by render
+        for( int r = 0; r < 10; r++ )
+        {
+            PipelineTestData d = { 1000, 5, 0, 0, 0 };
+            CvPipelineStats stats = cvRunPipeline( pipelineCapture, pipelineTrackStop,
+                                                   pipelineRenderAll, &d, 3, sizeof( int ) );
+            TS_ASSERT_EQUALS( stats.frames, 5 );
+            TS_ASSERT_EQUALS( d.rendered, 5 );
+            TS_ASSERT_EQUALS( d.out_of_order, 0 );
+        }
+    }
+};